@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Table-driven command dispatcher. A line is split into words once, its first one or two words
+// select a registered command by binary search over the sorted table, and the remaining words are
+// checked against the command's argument spec before the handler runs
+
+#define CMD_TABLE_MAX_COMMANDS 48
+#define CMD_TABLE_MAX_ARGS 8     // Words after the command name
+#define CMD_TABLE_MAX_LINE 64    // Including null terminator, longer lines are truncated
+
+// Writes a null terminated string to the console
+typedef void (*cmd_table_print_t)(const char* str);
+
+struct cmd_table_command;
+
+typedef struct {
+    const struct cmd_table_command* cmd;
+    int argc;                          // Words after the command name
+    char* argv[CMD_TABLE_MAX_ARGS];
+    uint64_t num[CMD_TABLE_MAX_ARGS];  // Parsed value of numeric arguments, 0 for words
+} cmd_table_args_t;
+
+// Returns true if the command changed the logging state, passed through by cmd_table_dispatch
+typedef bool (*cmd_table_handler_t)(const cmd_table_args_t* args, void* ctx);
+
+/**
+ * Argument spec, one character per word after the name:
+ *   u  unsigned 32-bit number
+ *   q  unsigned 64-bit number
+ *   s  any word, checked by the handler
+ * Uppercase marks an optional argument, optional ones must come last.
+ */
+typedef struct cmd_table_command {
+    const char* name;       // One or two words, e.g. "info" or "set period"
+    const char* args;       // Argument spec, "" or NULL for none
+    const char* usage;      // Shown in help and usage errors, e.g. "<ms> [to <ms>]", may be NULL
+    const char* help;
+    cmd_table_handler_t handler;
+} cmd_table_command_t;
+
+/**
+ * @brief Set output used for help, usage and unknown command messages
+ * @param print Console output, e.g. a UART send
+ */
+void cmd_table_init(cmd_table_print_t print);
+
+/**
+ * @brief Add a command, not thread-safe, register before dispatching from the console task
+ *
+ * The command is kept by reference and must stay valid. Help lists commands in registration order.
+ *
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for a bad name or spec,
+ *         ESP_ERR_INVALID_STATE if the name is taken, ESP_ERR_NO_MEM if the table is full
+ */
+esp_err_t cmd_table_register(const cmd_table_command_t* cmd);
+
+/**
+ * @brief Add count commands from a table, stops at the first one that fails
+ * @return ESP_OK on success, error of the failing command otherwise
+ */
+esp_err_t cmd_table_register_table(const cmd_table_command_t* cmds, size_t count);
+
+/**
+ * @brief Split line into space separated words in place
+ * @param line Modified, words are null terminated
+ * @param argv Receives up to max word pointers
+ * @return Number of words found, may exceed max
+ */
+int cmd_table_tokenize(char* line, char** argv, int max);
+
+/**
+ * @brief Run the command a line names
+ *
+ * Unknown commands and arguments that do not match the spec are reported with the print
+ * callback, the handler is not called.
+ *
+ * @param line Command line, copied before tokenizing
+ * @param ctx Passed to the handler
+ * @return Handler result, false if no handler ran
+ */
+bool cmd_table_dispatch(const char* line, void* ctx);
+
+// Print "Error: Usage is <name> <usage>", for handlers rejecting a word their spec allowed
+void cmd_table_print_usage(const cmd_table_command_t* cmd);
+
+// Print all registered commands with usage and help
+void cmd_table_print_help(void);
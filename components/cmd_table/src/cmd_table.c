@@ -0,0 +1,214 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "esp_log.h"
+
+#include "cmd_table.h"
+
+static const char *TAG = "cmd_table";
+
+static const cmd_table_command_t* s_commands[CMD_TABLE_MAX_COMMANDS];  // Registration order, for help
+static const cmd_table_command_t* s_sorted[CMD_TABLE_MAX_COMMANDS];    // By name, for lookup
+static size_t s_count = 0;
+static cmd_table_print_t s_print = NULL;
+
+static void cmd_table_print(const char* str)
+{
+    if (s_print) s_print(str);
+}
+
+void cmd_table_init(cmd_table_print_t print)
+{
+    s_print = print;
+}
+
+// Name is one word, or two separated by a single space
+static bool cmd_table_name_valid(const char* name)
+{
+    size_t len = name ? strlen(name) : 0;
+    const char* space = name ? strchr(name, ' ') : NULL;
+    if (len == 0 || len >= CMD_TABLE_MAX_LINE || name[0] == ' ' || name[len - 1] == ' ') return false;
+    return !space || (space[1] != ' ' && !strchr(space + 1, ' '));
+}
+
+static bool cmd_table_spec_valid(const char* spec)
+{
+    bool optional = false;
+    size_t len = spec ? strlen(spec) : 0;
+    if (len > CMD_TABLE_MAX_ARGS) return false;
+    for (size_t i = 0; i < len; i++) {
+        char type = (char)tolower((unsigned char)spec[i]);
+        if (type != 'u' && type != 'q' && type != 's') return false;
+        if (isupper((unsigned char)spec[i])) {
+            optional = true;
+        } else if (optional) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int cmd_table_find_slot(const char* name, bool* found)
+{
+    int lo = 0;
+    int hi = (int)s_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(name, s_sorted[mid]->name);
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    *found = false;
+    return lo;
+}
+
+static const cmd_table_command_t* cmd_table_find(const char* name)
+{
+    bool found;
+    int slot = cmd_table_find_slot(name, &found);
+    return found ? s_sorted[slot] : NULL;
+}
+
+esp_err_t cmd_table_register(const cmd_table_command_t* cmd)
+{
+    if (!cmd || !cmd->handler || !cmd_table_name_valid(cmd->name) || !cmd_table_spec_valid(cmd->args)) {
+        ESP_LOGE(TAG, "Invalid command '%s'", (cmd && cmd->name) ? cmd->name : "");
+        return ESP_ERR_INVALID_ARG;
+    }
+    bool found;
+    int slot = cmd_table_find_slot(cmd->name, &found);
+    if (found) {
+        ESP_LOGE(TAG, "Command '%s' already registered", cmd->name);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_count == CMD_TABLE_MAX_COMMANDS) {
+        ESP_LOGE(TAG, "Command table full, raise CMD_TABLE_MAX_COMMANDS");
+        return ESP_ERR_NO_MEM;
+    }
+
+    memmove(&s_sorted[slot + 1], &s_sorted[slot], (s_count - slot) * sizeof(s_sorted[0]));
+    s_sorted[slot] = cmd;
+    s_commands[s_count++] = cmd;
+    return ESP_OK;
+}
+
+esp_err_t cmd_table_register_table(const cmd_table_command_t* cmds, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        esp_err_t err = cmd_table_register(&cmds[i]);
+        if (err != ESP_OK) return err;
+    }
+    return ESP_OK;
+}
+
+int cmd_table_tokenize(char* line, char** argv, int max)
+{
+    int count = 0;
+    char* p = line;
+    for (;;) {
+        while (*p == ' ') p++;
+        if (*p == '\0') return count;
+        if (count < max) argv[count] = p;
+        count++;
+        while (*p != ' ' && *p != '\0') p++;
+        if (*p == '\0') return count;
+        *p++ = '\0';
+    }
+}
+
+static bool cmd_table_parse_number(const char* word, uint64_t max, uint64_t* value)
+{
+    char* end;
+    if (!isdigit((unsigned char)word[0])) return false;
+    errno = 0;
+    unsigned long long v = strtoull(word, &end, 10);
+    if (errno == ERANGE || *end != '\0' || v > max) return false;
+    *value = v;
+    return true;
+}
+
+// Check argc against the spec and parse numeric arguments
+static bool cmd_table_parse_args(const char* spec, cmd_table_args_t* args)
+{
+    int total = spec ? (int)strlen(spec) : 0;
+    int required = 0;
+    while (required < total && islower((unsigned char)spec[required])) required++;
+    if (args->argc < required || args->argc > total) return false;
+
+    for (int i = 0; i < args->argc; i++) {
+        char type = (char)tolower((unsigned char)spec[i]);
+        args->num[i] = 0;
+        if (type == 'u' && !cmd_table_parse_number(args->argv[i], UINT32_MAX, &args->num[i])) return false;
+        if (type == 'q' && !cmd_table_parse_number(args->argv[i], UINT64_MAX, &args->num[i])) return false;
+    }
+    return true;
+}
+
+bool cmd_table_dispatch(const char* line, void* ctx)
+{
+    char buf[CMD_TABLE_MAX_LINE];
+    char* words[CMD_TABLE_MAX_ARGS + 2];
+    snprintf(buf, sizeof(buf), "%s", line);
+    int count = cmd_table_tokenize(buf, words, CMD_TABLE_MAX_ARGS + 2);
+
+    // Two-word names take precedence, "dump from" over "dump"
+    const cmd_table_command_t* cmd = NULL;
+    int skip = 0;
+    if (count >= 2) {
+        char key[CMD_TABLE_MAX_LINE];
+        snprintf(key, sizeof(key), "%s %s", words[0], words[1]);
+        cmd = cmd_table_find(key);
+        skip = 2;
+    }
+    if (!cmd && count >= 1) {
+        cmd = cmd_table_find(words[0]);
+        skip = 1;
+    }
+    if (!cmd) {
+        cmd_table_print("Unknown command. Type 'help' for commands.\r\n");
+        return false;
+    }
+
+    cmd_table_args_t args = { .cmd = cmd, .argc = count - skip };
+    if (args.argc > CMD_TABLE_MAX_ARGS) {
+        cmd_table_print_usage(cmd);
+        return false;
+    }
+    memcpy(args.argv, &words[skip], args.argc * sizeof(args.argv[0]));
+    if (!cmd_table_parse_args(cmd->args, &args)) {
+        cmd_table_print_usage(cmd);
+        return false;
+    }
+    ESP_LOGD(TAG, "Running '%s' with %d args", cmd->name, args.argc);
+    return cmd->handler(&args, ctx);
+}
+
+void cmd_table_print_usage(const cmd_table_command_t* cmd)
+{
+    char msg[CMD_TABLE_MAX_LINE + 64];
+    snprintf(msg, sizeof(msg), "Error: Usage is %s%s%s\r\n", cmd->name,
+             cmd->usage ? " " : "", cmd->usage ? cmd->usage : "");
+    cmd_table_print(msg);
+}
+
+void cmd_table_print_help(void)
+{
+    cmd_table_print("Available commands:\r\n");
+    for (size_t i = 0; i < s_count; i++) {
+        const cmd_table_command_t* cmd = s_commands[i];
+        char line[192];
+        snprintf(line, sizeof(line), "  %s%s%s - %s\r\n", cmd->name, cmd->usage ? " " : "",
+                 cmd->usage ? cmd->usage : "", cmd->help ? cmd->help : "");
+        cmd_table_print(line);
+    }
+}
@@ -0,0 +1,306 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "sensors.h"
+#include "stats.h"
+
+// Sensor log in a data partition. The first sector journals the application's settings and
+// checkpoints of the write head, log sectors follow and are written in sequence, wrapping in ring
+// mode. Log sectors may continue past the end of the partition on further storage backends.
+// Entries are staged in RTC memory and committed a flash page (raw) or a block (packed) at a time.
+// Functions that read or change the log expect the caller to hold log_storage_lock() unless they
+// say otherwise
+
+#define LOG_START 4096                    // First log sector, settings journal and checkpoints before it
+#define FLASH_SECTOR_SIZE 4096
+#define FLASH_PAGE_SIZE 256               // Entries are committed to flash in whole pages
+#define PRE_ERASE_THRESHOLD_PCT 50        // Fill level of current sector at which the next one is erased in background
+#define CHECKPOINT_INTERVAL_SECTORS 4     // Checkpoint written every N opened log sectors
+#define FLUSH_MAX_LATENCY_MS 2000         // Max time an entry may wait in RAM before a partial page is flushed
+#define DATA_SPLICE_GAP_MS 60000          // Gap assumed after a power loss, the clock restarts so the real one is unknown (60s)
+#define LOG_READ_MMAP 1                   // Read flash through a memory mapping of the partition instead of driver calls
+#define LOG_SETTINGS_MAX_SIZE 64          // Largest settings struct the journal holds
+#define LOG_MAX_BACKENDS 4                // Storage the log may continue on besides its partition
+
+// Formats of log sectors, log_set_format
+#define LOG_FORMAT_RAW    0U
+#define LOG_FORMAT_PACKED 1U
+
+// Sector header flags
+#define SECTOR_FLAG_SPLICE     0x1U     // Log time jumped before the first entry (power loss or `set time`), gap not measured
+#define SECTOR_FLAG_WALL_CLOCK 0x2U     // Log time is Unix time in ms, set with `set time`
+
+// Log entry, one value per channel and burst statistic of the sensor table. NaN marks a channel that
+// was not due on this period or failed to read
+typedef struct {
+    uint64_t timestamp;       // Log time in ms
+    float values[SENSOR_VALUE_COUNT];
+} __attribute__((packed)) log_entry_t;
+
+// Log entry as stored in raw sectors, time is kept relative to the sector's base time
+typedef struct {
+    uint32_t offset_ms;       // Timestamp minus sector base_ms
+    float values[SENSOR_VALUE_COUNT];
+} __attribute__((packed)) raw_entry_t;
+
+// Header at the start of every log sector. Sectors are opened in sequence order and sequence
+// number seq always lives in physical sector seq % (log sectors in the partition), which lets the
+// log wrap. Entry numbers count from the last reset, so a sector ends where the next one starts.
+// Log time never decreases, so base times of consecutive sectors double as a sparse time index
+typedef struct {
+    uint32_t magic;           // Tells raw and packed sectors apart
+    uint32_t seq;             // Logical sector number since last reset
+    uint32_t first_index;     // Entry number of first entry in sector
+    uint32_t flags;           // SECTOR_FLAG_*
+    uint64_t base_ms;         // Log time entry times count from, at most the first entry's
+    uint32_t erase_count;     // Erases of this physical sector, stamped right after each erase
+    uint32_t erase_check;     // ~erase_count, keeps the count readable once the magic is cleared
+    uint32_t crc;             // CRC32 over preceding fields
+} __attribute__((packed)) sector_header_t;
+
+#define ENTRIES_PER_SECTOR ((FLASH_SECTOR_SIZE - sizeof(sector_header_t)) / sizeof(raw_entry_t))  // Raw sectors, before commit records
+
+// Encoder/decoder position in a packed sector
+typedef struct {
+    uint32_t offset;          // Sector offset of next block or next entry of current block, 0 if sector not opened
+    uint32_t block_end;       // Sector offset after current block
+    uint32_t block_left;      // Entries not yet decoded in current block
+    uint32_t entries;         // Entries before offset
+    uint64_t base_ms;         // Sector base time
+    uint32_t prev_ts;         // Offset from base_ms
+    int32_t prev_dt;
+    int32_t prev_q[SENSOR_VALUE_COUNT];  // Last present value per column
+} packed_state_t;
+
+// Sequential reader over retained entries, one sector at a time, decoded in place from the
+// mapping or from a copy of the sector
+typedef struct {
+    const uint8_t* data;      // Contents of sector seq
+    uint32_t seq;             // Sector being read
+    uint32_t magic;           // Format of that sector
+    uint32_t first;           // Entry number of its first entry
+    uint32_t end;             // Entry number where the next sector starts, UINT32_MAX if not opened yet
+    uint32_t index;           // Entry number of next entry
+    uint64_t base_ms;         // Base time of that sector
+    packed_state_t packed;
+} log_reader_t;
+
+// Storage state kept by the application in RTC memory across deep sleep, see log_storage_suspend
+typedef struct {
+    uint32_t num_entries;
+    uint32_t tail_seq;
+    uint32_t tail_first;
+    uint32_t erased_sector;
+    uint32_t settings_slot;
+    uint32_t settings_seq;
+    uint32_t checkpoint_slot;
+    uint32_t checkpoint_seq;
+    uint32_t dropped;
+    bool log_full;
+} log_storage_state_t;
+
+// Storage the log continues on after the end of its partition, such as a further data partition or
+// an external SPI NOR chip registered with esp_partition_register_external. It must behave like NOR
+// flash: erased bytes read 0xFF, writes only clear bits and erases cover whole sectors. Offsets are
+// from the start of the backend
+typedef struct {
+    esp_err_t (*read)(void* ctx, uint32_t offset, void* dst, size_t len);
+    esp_err_t (*write)(void* ctx, uint32_t offset, const void* src, size_t len);
+    esp_err_t (*erase)(void* ctx, uint32_t offset, size_t len);   // Whole FLASH_SECTOR_SIZE sectors
+    uint32_t size;            // Bytes, a multiple of FLASH_SECTOR_SIZE
+    void* ctx;                // Passed to every call
+} log_backend_t;
+
+// Erase counts across the partition, see log_storage_wear
+typedef struct {
+    uint32_t min;             // Fewest erases of a log sector
+    uint32_t max;             // Most erases of a log sector
+    float mean;
+    uint32_t settings;        // Erases of the settings sector
+} log_wear_t;
+
+// Instrumentation for the stats command
+typedef struct {
+    stats_op_t erase;         // Sector erases, background and synchronous
+    stats_op_t write;         // esp_partition_write calls of any size
+    uint32_t dropped;         // Entries lost because the linear log was full
+} log_storage_stats_t;
+
+// Called for every entry of a scan, ctx is passed through
+typedef void (*entry_visitor_t)(const log_entry_t* entry, void* ctx);
+
+/**
+ * @brief Continue the log on a backend after the end of the partition, before log_storage_init
+ *
+ * Backends follow the partition in the order they are added and only hold log sectors. Adding,
+ * removing or resizing one moves sectors, so the log has to be formatted after such a change.
+ *
+ * @param backend Copied, its ctx must stay valid
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE unless size is a non-zero multiple of FLASH_SECTOR_SIZE,
+ *         ESP_ERR_NO_MEM once LOG_MAX_BACKENDS are added, ESP_ERR_INVALID_STATE after log_storage_init
+ */
+esp_err_t log_storage_add_backend(const log_backend_t* backend);
+
+// Backend for a further data partition, calls the esp_partition driver
+void log_backend_partition(const esp_partition_t* partition, log_backend_t* backend);
+
+/**
+ * @brief Prepare the storage for a partition, before any other call
+ *
+ * Creates the storage and erase locks. Reads go through the driver until log_storage_map().
+ *
+ * @param flash Data partition holding the settings journal and the first log sectors
+ * @param settings_size Size of the application's settings struct, at most LOG_SETTINGS_MAX_SIZE
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if the partition, backends or settings do not fit,
+ *         ESP_ERR_NOT_SUPPORTED if the partition is encrypted, ESP_ERR_NO_MEM
+ */
+esp_err_t log_storage_init(const esp_partition_t* flash, size_t settings_size);
+
+// Map the whole partition for reads (LOG_READ_MMAP), reads keep going through the driver if the MMU has
+// no room for it. Backends are always read through their read call
+void log_storage_map(const esp_partition_t* flash);
+
+// Start the task that erases the sector after the write head ahead of time, flushes erase synchronously until then
+esp_err_t log_storage_start(const esp_partition_t* flash, uint32_t erase_task_priority);
+
+// Serializes log writes, counters and the settings journal between tasks
+void log_storage_lock(void);
+void log_storage_unlock(void);
+
+/**
+ * @brief Load the newest valid settings record from the journal
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if the journal holds no valid record
+ */
+esp_err_t log_settings_load(const esp_partition_t* flash, void* settings);
+
+// Append settings to the journal, the sector is only erased once it is full. Takes the lock itself
+esp_err_t log_settings_save(const esp_partition_t* flash, const void* settings);
+
+// Erase the settings sector and journal settings as its only record, keeps the log. For settings lost
+// to a power cut while the sector was compacted, takes the lock itself
+esp_err_t log_settings_reset(const esp_partition_t* flash, const void* settings);
+
+// Whether any log sector holds a valid header, i.e. the partition carries a log worth recovering
+bool log_storage_has_log(const esp_partition_t* flash);
+
+/**
+ * @brief Drop the log and start an empty linear raw log, with settings as the only journal record
+ *
+ * Headers of log sectors are dropped like clear does, on the partition and every backend. Only the
+ * settings sector and the least-worn log sector, where the new log starts, are erased. The other
+ * sectors are erased once the write head reaches them. Erase counts are carried over.
+ */
+esp_err_t log_storage_format(const esp_partition_t* flash, const void* settings);
+
+/**
+ * @brief Recover tail and write head after reset or power cycle, then commit entries a brownout or
+ * software reset left in the RTC staging buffer
+ *
+ * @param ring_mode Reclaim the oldest sector instead of stopping when the log is full
+ * @param format LOG_FORMAT_* of sectors opened from now on
+ * @return Number of retained entries
+ */
+uint32_t log_storage_recover(const esp_partition_t* flash, bool ring_mode, uint8_t format);
+
+// Snapshot state for deep sleep, waits for a background erase and keeps the erase task from starting another
+void log_storage_suspend(log_storage_state_t* state);
+
+// Pick up state saved by log_storage_suspend after a timer wakeup, settings are the ones journaled last
+void log_storage_resume(const log_storage_state_t* state, const void* settings, bool ring_mode, uint8_t format);
+
+// Log time in ms, never decreases across resets and power loss. Needs no lock
+uint64_t log_time_ms(void);
+
+// Whether log time is Unix time, see log_set_time
+bool log_clock_is_wall(void);
+
+// Pick up log time after a reset, or continue DATA_SPLICE_GAP_MS after the newest entry after a power loss
+void log_clock_restore(const esp_partition_t* flash);
+
+/**
+ * @brief Switch log time to Unix time, the next entry starts a sector marked as splice
+ *
+ * Staged entries must have been committed first.
+ *
+ * @param time_ms Unix time in ms, must be after the newest entry
+ * @param newest_ms Set to the log time of the newest entry
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if time_ms is not after the newest entry
+ */
+esp_err_t log_set_time(const esp_partition_t* flash, uint64_t time_ms, uint64_t* newest_ms);
+
+// Stage entry in RAM, flash is only written once a page is full
+esp_err_t log_data_entry(const esp_partition_t* flash, log_entry_t* entry);
+
+// Commit staged entries, a failure restarts the flush latency so a timed retry backs off
+esp_err_t log_flush(const esp_partition_t* flash);
+
+// Time until staged entries reach FLUSH_MAX_LATENCY_MS, 0 if overdue, UINT32_MAX if nothing is staged
+uint32_t log_flush_wait_ms(void);
+
+// Remove the newest count entries from flash, count at most log_storage_count()
+esp_err_t log_truncate(const esp_partition_t* flash, uint32_t count);
+
+// Ring mode on or off, clears a reported full log
+void log_set_ring_mode(bool ring_mode);
+
+// Format of sectors opened from now on, also applies to a staged sector not on flash yet
+void log_set_format(uint8_t format);
+
+// Retained entries on flash, staged ones not counted
+uint32_t log_storage_count(void);
+
+// Entry number of the oldest retained entry, entry numbers count from the last reset. Needs no lock
+uint32_t log_storage_first(void);
+
+// Staged entries not on flash yet
+uint32_t log_storage_pending(void);
+
+// Bytes of log sectors in use, and in the partition and backends
+uint32_t log_storage_used_bytes(void);
+uint32_t log_storage_size_bytes(void);
+
+// Sequence numbers of the oldest retained sector and of the head sector
+void log_storage_sectors(uint32_t* tail_seq, uint32_t* head_seq);
+
+// Erase counts of every log sector and of the settings sector, read from their stamps
+void log_storage_wear(const esp_partition_t* flash, log_wear_t* wear);
+
+// Read header of the sector for seq, false unless it holds exactly that sequence number. Needs no lock
+bool log_read_sector_header(const esp_partition_t* flash, uint32_t seq, sector_header_t* header);
+
+// Position reader at entry number index, false if its sector was reclaimed meanwhile. Needs no lock
+bool log_reader_seek(const esp_partition_t* flash, log_reader_t* reader, uint32_t index);
+
+// Read entry at reader position, moves on to the next sector at the end of one. Needs no lock
+bool log_reader_next(const esp_partition_t* flash, log_reader_t* reader, log_entry_t* entry);
+
+// Read retained entry by index, 0 is the oldest entry
+esp_err_t log_read_entry(const esp_partition_t* flash, uint32_t index, log_entry_t* entry);
+
+/**
+ * @brief Visit entries from entry number pos up to end stamped within from_ms..to_ms
+ *
+ * Entries below the head snapshot in pos..end are immutable, so no lock is needed. Ring mode may
+ * reclaim the oldest sectors meanwhile, the scan continues at the new tail if it does.
+ *
+ * @return Number of entries visited
+ */
+uint32_t log_scan(const esp_partition_t* flash, uint32_t pos, uint32_t end, uint64_t from_ms, uint64_t to_ms,
+                  entry_visitor_t visit, void* ctx);
+
+// First entry number worth scanning for entries at or after from_ms, given the retained range pos..end. Needs no lock
+uint32_t log_locate_time(const esp_partition_t* flash, uint32_t pos, uint32_t end, uint64_t from_ms);
+
+// Read every sector header like recovery without a checkpoint does, for benchmarks. Needs no lock
+bool log_find_newest_sector(const esp_partition_t* flash, uint32_t* newest);
+
+// Read through the mapping or the driver, for benchmarks. Returns false if the partition is not mapped
+bool log_storage_use_map(bool mapped);
+
+// Background pre-erase on (default) or off, for benchmarks. Off, every flush that opens a sector erases it first
+void log_storage_set_pre_erase(bool enabled);
+
+log_storage_stats_t* log_storage_get_stats(void);
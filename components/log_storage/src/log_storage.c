@@ -0,0 +1,1893 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_rom_crc.h"
+#include "esp_log.h"
+
+#include "log_storage.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <sys/time.h>
+
+static const char *TAG = "log_storage";
+
+#define CHECKPOINT_OFFSET 2048            // Settings journal before this offset, write-head checkpoints after
+#define LOG_SECTOR_MAGIC 0x4C4F4753       // "LOGS", marks a log sector header
+#define LOG_SECTOR_MAGIC_PACKED 0x4C4F4750 // "LOGP", marks a log sector with delta-encoded entries
+#define CLOCK_MAGIC 0xC10C7133          // Marks RTC log clock offset as valid across resets
+#define NO_SECTOR 0xFFFFFFFF
+#define STAGING_MAGIC 0x5748A6E4        // Marks RTC staging buffer as valid across resets
+#define PACKED_BLOCK_MAX_BYTES 255      // Encoded bytes per packed block, length is a single byte
+#define PACKED_ENTRY_MAX_BYTES (5 * (1 + SENSOR_VALUE_COUNT))  // Worst case entry, one 5-byte varint per field
+#define PACKED_VALUE_LIMIT 1000000000   // Fixed point values are clamped to +-limit so deltas never overflow
+
+#if PACKED_ENTRY_MAX_BYTES > PACKED_BLOCK_MAX_BYTES
+#error "Too many sensor columns for a packed block, enable fewer channels or statistics"
+#endif
+
+static uint32_t s_num_entries = 0;
+static SemaphoreHandle_t s_storage_mutex = NULL;  // Guards flash log writes and s_num_entries
+static log_storage_stats_t s_stats;
+
+// Log time is the system clock plus an offset that keeps it increasing across power loss. The system
+// clock runs on through deep sleep and every reset but power-on, so the offset is kept in RTC memory
+typedef struct {
+    uint32_t magic;
+    uint32_t wall_clock;      // System clock was set to Unix time
+    uint64_t offset_ms;       // Log time minus system clock, wraps for negative offsets
+} log_clock_t;
+
+static RTC_NOINIT_ATTR log_clock_t s_clock;
+
+// System clock, keeps running through deep sleep unlike esp_timer
+static uint64_t rtc_time_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+uint64_t log_time_ms(void)
+{
+    return rtc_time_ms() + s_clock.offset_ms;
+}
+
+// Settings journal record (from offset 0), newest record with valid CRC wins on boot. The settings
+// struct belongs to the application, records are seq, its bytes and a CRC32 over both
+#define SETTINGS_RECORD_SIZE(size) (sizeof(uint32_t) + (size) + sizeof(uint32_t))
+
+static size_t s_settings_size = 0;
+static uint32_t s_settings_slots = 0;        // Records that fit before CHECKPOINT_OFFSET
+static uint32_t s_settings_slot = 0;         // Next free journal slot
+static uint32_t s_settings_seq = 0;          // Sequence number of newest record
+static uint8_t s_saved_settings[LOG_SETTINGS_MAX_SIZE];  // Newest persisted settings, rewritten when sector is compacted
+
+// Raw sectors end in commit records growing down from the sector end, one per flushed batch and written
+// after its entries. Entries only count once their record is on flash, so boot tells a write torn by a
+// power loss from a complete one
+typedef struct {
+    uint16_t end_slot;        // Slot after the batch, the batch starts where the previous one ended
+    uint16_t crc;             // CRC16 over end_slot and the batch entries
+} __attribute__((packed)) commit_record_t;
+
+#define ENTRIES_PER_PAGE (FLASH_PAGE_SIZE / sizeof(raw_entry_t))
+#define STAGING_SLOTS (ENTRIES_PER_PAGE + 1)  // Entries not dividing the page size may straddle both its ends
+
+// Packed sectors hold blocks of varint-encoded entries after the header. The first entry of a sector
+// is stored absolute, every other one as zigzag varints of the change in sample interval and the
+// change of each channel value (fixed point), so a steady log takes about a byte per field. Every
+// block is one flush, its CRC doubles as the commit record
+typedef struct {
+    uint8_t count;            // Entries in block, erased (0xFF) marks end of sector
+    uint8_t length;           // Encoded bytes following
+    uint16_t crc;             // CRC16 over count, length and the encoded bytes
+} __attribute__((packed)) packed_block_t;
+
+// Where the next entry goes in the log
+typedef struct {
+    uint32_t seq;             // Log sector
+    uint32_t sector_first;    // Entry number of first entry in that sector
+    uint32_t slot;            // Entries already in that sector
+    uint32_t format;          // LOG_FORMAT_* of that sector
+    uint32_t commits;         // Commit records in that sector for raw sectors
+    uint64_t base_ms;         // Base time of that sector once opened
+    bool opened;              // Sector already has its header on flash
+    bool torn;                // Sector holds a torn write after slot, appending there needs the same bytes
+    packed_state_t packed;    // Encoder state at slot for packed sectors
+} log_position_t;
+
+static uint32_t s_total_sectors = 0;     // Log sectors in partition and backends
+static uint32_t s_tail_seq = 0;          // Sequence number of oldest retained sector
+static uint32_t s_tail_first = 0;        // Entry number of oldest retained entry
+static bool s_ring_mode = false;         // Reclaim oldest sector when full instead of stopping
+static bool s_log_full = false;          // Linear log ran out of sectors, reported once
+static uint8_t s_log_format = LOG_FORMAT_RAW;  // Format of newly opened sectors
+
+// Write-head checkpoint (appended in settings sector from CHECKPOINT_OFFSET)
+typedef struct {
+    uint32_t seq;             // Log sector opened when checkpoint was taken
+    uint32_t inverted;        // ~seq, rejects torn records
+} __attribute__((packed)) checkpoint_t;
+
+// Erase count, stamped right after every erase so the count outlives the data. Log sectors keep it in
+// their header (erase_count, erase_check), the settings sector in its last bytes
+typedef struct {
+    uint32_t count;
+    uint32_t inverted;        // ~count, rejects erased and torn stamps
+} __attribute__((packed)) wear_stamp_t;
+
+#define WEAR_STAMP_OFFSET (LOG_START - sizeof(wear_stamp_t))  // Stamp of the settings sector, after the checkpoints
+#define CHECKPOINT_SLOTS ((WEAR_STAMP_OFFSET - CHECKPOINT_OFFSET) / sizeof(checkpoint_t))
+
+static uint32_t s_checkpoint_slot = 0;       // Next free checkpoint slot
+static uint32_t s_checkpoint_seq = NO_SECTOR; // Sector of newest checkpoint, NO_SECTOR if none
+
+// Staging buffer, kept in RTC memory so unflushed entries survive brownout and software resets.
+// Raw sectors stage one flash page at a time, packed sectors append a block per flush
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;             // Log sector the buffered entries go to
+    uint32_t sector_first;    // Entry number of first entry in that sector
+    uint32_t first_slot;      // Sector slot of entries[0], first slot of a flash page in raw sectors
+    uint32_t capacity;        // Entries that fit in this flash page or block
+    uint32_t count;           // Entries filled
+    uint32_t flushed;         // Entries already written to flash
+    uint32_t checksum;        // XOR of entry words, validates buffer after reset
+    uint32_t format;          // LOG_FORMAT_* of sector seq
+    uint32_t opened;          // Sector seq has its header on flash
+    uint32_t commits;         // Commit records in raw sector seq
+    uint32_t flags;           // SECTOR_FLAG_* for sector seq when it gets opened
+    uint64_t base_ms;         // Base time of sector seq once opened
+    packed_state_t packed;    // Append position in packed sector
+    log_entry_t entries[STAGING_SLOTS];
+} staging_page_t;
+
+static RTC_NOINIT_ATTR staging_page_t s_staging;
+static int64_t s_staging_oldest_us = 0;   // When the oldest unflushed entry was staged
+
+// Background pre-erase, s_erase_mutex is held for the duration of every log sector erase
+static TaskHandle_t s_erase_task = NULL;
+static SemaphoreHandle_t s_erase_mutex = NULL;
+static volatile uint32_t s_erase_request = NO_SECTOR;  // Physical sector the erase task should prepare next
+static portMUX_TYPE s_erase_request_lock = portMUX_INITIALIZER_UNLOCKED;  // Posting a request never waits on an erase
+static uint32_t s_erased_sector = NO_SECTOR;           // Physical sector known to be erased ahead of the write head
+static bool s_pre_erase = true;                        // Off only while a benchmark measures flushes without it
+
+// Whole log sector for decoding, only used from the main task
+static uint8_t s_sector_buf[FLASH_SECTOR_SIZE] __attribute__((aligned(4)));
+static log_entry_t s_rewrite_entries[STAGING_SLOTS];  // Entries of the packed block sector_rewrite cuts
+
+// Storage after the end of the partition, in the order it was added. Offsets below address the
+// partition followed by every backend, sectors never straddle two of them
+static log_backend_t s_backends[LOG_MAX_BACKENDS];
+static uint32_t s_num_backends = 0;
+
+// Partition mapped through the flash cache, NULL while reads go through esp_partition_read. Writes
+// and erases invalidate the cached lines, so the mapping always shows current flash contents
+static const uint8_t* s_flash_map = NULL;
+static const uint8_t* s_flash_map_base = NULL;  // The mapping, also while benchmarks read through the driver
+static esp_partition_mmap_handle_t s_flash_map_handle;
+
+// Backend holding offset, which is made relative to it. NULL for offsets within the partition
+static const log_backend_t* backend_at(const esp_partition_t* flash, uint32_t* offset)
+{
+    uint32_t rel = *offset;
+    if (rel < flash->size) {
+        return NULL;
+    }
+    rel -= flash->size;
+    for (uint32_t i = 0; i < s_num_backends; i++) {
+        if (rel < s_backends[i].size) {
+            *offset = rel;
+            return &s_backends[i];
+        }
+        rel -= s_backends[i].size;
+    }
+    return NULL;  // Past the end, the partition driver rejects it
+}
+
+// Copy len bytes at an offset, from the mapping when there is one
+static esp_err_t partition_read(const esp_partition_t* flash, uint32_t offset, void* dst, size_t len)
+{
+    if (s_flash_map && offset < flash->size) {
+        memcpy(dst, s_flash_map + offset, len);
+        return ESP_OK;
+    }
+    const log_backend_t* backend = backend_at(flash, &offset);
+    return backend ? backend->read(backend->ctx, offset, dst, len) : esp_partition_read(flash, offset, dst, len);
+}
+
+static esp_err_t partition_write(const esp_partition_t* flash, uint32_t offset, const void* src, size_t len)
+{
+    int64_t start_us = stats_begin();
+    const log_backend_t* backend = backend_at(flash, &offset);
+    esp_err_t err = backend ? backend->write(backend->ctx, offset, src, len) : esp_partition_write(flash, offset, src, len);
+    stats_end(&s_stats.write, start_us);
+    return err;
+}
+
+// len must not run past the partition or backend holding offset
+static esp_err_t partition_erase(const esp_partition_t* flash, uint32_t offset, size_t len)
+{
+    int64_t start_us = stats_begin();
+    const log_backend_t* backend = backend_at(flash, &offset);
+    esp_err_t err = backend ? backend->erase(backend->ctx, offset, len) : esp_partition_erase_range(flash, offset, len);
+    stats_end(&s_stats.erase, start_us);
+    return err;
+}
+
+// Stamp of physical log sector
+static inline uint32_t sector_wear_offset(uint32_t sector)
+{
+    return LOG_START + sector * FLASH_SECTOR_SIZE + offsetof(sector_header_t, erase_count);
+}
+
+// Erases recorded by the stamp at offset, 0 if it is erased or torn
+static uint32_t wear_read(const esp_partition_t* flash, uint32_t offset)
+{
+    wear_stamp_t stamp;
+    partition_read(flash, offset, &stamp, sizeof(stamp));
+    return (stamp.inverted == ~stamp.count) ? stamp.count : 0;
+}
+
+static esp_err_t wear_write(const esp_partition_t* flash, uint32_t offset, uint32_t count)
+{
+    wear_stamp_t stamp = { .count = count, .inverted = ~count };
+    return partition_write(flash, offset, &stamp, sizeof(stamp));
+}
+
+// Erase the sector at offset and stamp it with one more erase than before. A power loss before the
+// stamp is written loses the count, the sector starts over from this erase
+static esp_err_t wear_erase(const esp_partition_t* flash, uint32_t offset, uint32_t stamp_offset)
+{
+    uint32_t count = wear_read(flash, stamp_offset) + 1;
+    esp_err_t err = partition_erase(flash, offset, FLASH_SECTOR_SIZE);
+    if (err == ESP_OK) {
+        err = wear_write(flash, stamp_offset, count);
+    }
+    return err;
+}
+
+// Erase physical log sector, caller must hold s_erase_mutex
+static esp_err_t sector_erase(const esp_partition_t* flash, uint32_t sector)
+{
+    return wear_erase(flash, LOG_START + sector * FLASH_SECTOR_SIZE, sector_wear_offset(sector));
+}
+
+// Take the stamp of the freshly erased physical sector into header as flash holds it, a torn or
+// missing stamp included, so the header CRC matches what sector_head_write leaves on flash
+static void sector_header_stamp(const esp_partition_t* flash, uint32_t sector, sector_header_t* header)
+{
+    wear_stamp_t stamp;
+    partition_read(flash, sector_wear_offset(sector), &stamp, sizeof(stamp));
+    header->erase_count = stamp.count;
+    header->erase_check = stamp.inverted;
+}
+
+// Write the first len bytes of a freshly erased sector, header first, around the stamp the erase left,
+// so the stamp words are programmed once
+static esp_err_t sector_head_write(const esp_partition_t* flash, uint32_t offset, const void* data, uint32_t len)
+{
+    const uint32_t stamp_start = offsetof(sector_header_t, erase_count);
+    const uint32_t stamp_end = stamp_start + sizeof(wear_stamp_t);
+    esp_err_t err = partition_write(flash, offset, data, stamp_start);
+    if (err == ESP_OK) {
+        err = partition_write(flash, offset + stamp_end, (const uint8_t*)data + stamp_end, len - stamp_end);
+    }
+    return err;
+}
+
+void log_storage_map(const esp_partition_t* flash)
+{
+#if LOG_READ_MMAP
+    const void* ptr;
+    esp_err_t err = esp_partition_mmap(flash, 0, flash->size, ESP_PARTITION_MMAP_DATA, &ptr, &s_flash_map_handle);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Partition mmap failed (%s), reading through driver", esp_err_to_name(err));
+        return;
+    }
+    s_flash_map = ptr;
+    s_flash_map_base = ptr;
+    ESP_LOGI(TAG, "Partition mapped at %p", ptr);
+#endif
+}
+
+static inline uint32_t sector_offset(uint32_t seq)
+{
+    return LOG_START + (seq % s_total_sectors) * FLASH_SECTOR_SIZE;
+}
+
+static inline uint32_t slot_offset(uint32_t seq, uint32_t slot)
+{
+    return sector_offset(seq) + sizeof(sector_header_t) + slot * sizeof(raw_entry_t);
+}
+
+static inline uint32_t commit_offset(uint32_t seq, uint32_t commit)
+{
+    return sector_offset(seq) + FLASH_SECTOR_SIZE - (commit + 1) * sizeof(commit_record_t);
+}
+
+// Slots left for entries in a raw sector holding commits commit records
+static inline uint32_t raw_slot_limit(uint32_t commits)
+{
+    return (FLASH_SECTOR_SIZE - sizeof(sector_header_t) - commits * sizeof(commit_record_t)) / sizeof(raw_entry_t);
+}
+
+static uint16_t commit_crc(uint16_t end_slot, const void* entries, uint32_t len)
+{
+    uint16_t crc = esp_rom_crc16_le(0, (const uint8_t*)&end_slot, sizeof(end_slot));
+    return esp_rom_crc16_le(crc, (const uint8_t*)entries, len);
+}
+
+// Write position after committed slot of a raw sector, the next sector once no entry and commit record fit
+static log_position_t raw_position(uint32_t seq, uint32_t sector_first, uint64_t base_ms, uint32_t slot, uint32_t commits)
+{
+    if (slot >= raw_slot_limit(commits + 1)) {
+        return (log_position_t){ .seq = seq + 1, .sector_first = sector_first + slot, .format = s_log_format };
+    }
+    return (log_position_t){ .seq = seq, .sector_first = sector_first, .slot = slot, .format = LOG_FORMAT_RAW,
+                             .commits = commits, .base_ms = base_ms, .opened = true };
+}
+
+// block points at a packed block header followed by its encoded bytes
+static uint16_t packed_block_crc(const uint8_t* block)
+{
+    uint16_t crc = esp_rom_crc16_le(0, block, offsetof(packed_block_t, crc));
+    return esp_rom_crc16_le(crc, block + sizeof(packed_block_t), block[offsetof(packed_block_t, length)]);
+}
+
+// Entry number after the newest entry on flash
+static inline uint32_t log_end_index(void)
+{
+    return s_staging.sector_first + s_staging.first_slot + s_staging.flushed;
+}
+
+static uint32_t sector_header_crc(const sector_header_t* header)
+{
+    return esp_rom_crc32_le(0, (const uint8_t*)header, offsetof(sector_header_t, crc));
+}
+
+static bool sector_header_valid(const sector_header_t* header)
+{
+    return (header->magic == LOG_SECTOR_MAGIC || header->magic == LOG_SECTOR_MAGIC_PACKED) &&
+           header->crc == sector_header_crc(header);
+}
+
+// Read header of the sector for seq, false unless it holds exactly that sequence number (not erased, not an older lap)
+bool log_read_sector_header(const esp_partition_t* flash, uint32_t seq, sector_header_t* header)
+{
+    partition_read(flash, sector_offset(seq), header, sizeof(*header));
+    return sector_header_valid(header) && header->seq == seq;
+}
+
+static bool sector_has_seq(const esp_partition_t* flash, uint32_t seq)
+{
+    sector_header_t header;
+    return log_read_sector_header(flash, seq, &header);
+}
+
+static inline uint32_t zigzag_encode(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t zigzag_decode(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static uint32_t varint_put(uint8_t* out, uint32_t v)
+{
+    uint32_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+// Returns bytes consumed, 0 if the varint runs past end
+static uint32_t varint_get(const uint8_t* in, const uint8_t* end, uint32_t* v)
+{
+    uint32_t result = 0;
+    for (uint32_t n = 0; n < 5 && in + n < end; n++) {
+        result |= (uint32_t)(in[n] & 0x7F) << (7 * n);
+        if (!(in[n] & 0x80)) {
+            *v = result;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static const float k_pow10[] = { 1.0f, 10.0f, 100.0f, 1e3f, 1e4f, 1e5f, 1e6f };
+
+// Column values in packed sectors are fixed point with the channel's decimals
+static inline float column_scale(int col)
+{
+    uint8_t decimals = sensors_column_driver(col)->decimals;
+    return k_pow10[decimals < 6 ? decimals : 6];
+}
+
+static int32_t value_to_fixed(float value, int col)
+{
+    float scaled = value * column_scale(col);
+    if (scaled > PACKED_VALUE_LIMIT) return PACKED_VALUE_LIMIT;
+    if (scaled < -PACKED_VALUE_LIMIT) return -PACKED_VALUE_LIMIT;
+    return (int32_t)lroundf(scaled);
+}
+
+// Encode entry following the ones already in st, returns encoded bytes (at most PACKED_ENTRY_MAX_BYTES).
+// Column fields are zigzag delta + 1 against the column's last present value, 0 for a missing value
+static uint32_t packed_encode(packed_state_t* st, const log_entry_t* entry, uint8_t* out)
+{
+    uint32_t n;
+    uint32_t ts = (uint32_t)(entry->timestamp - st->base_ms);
+
+    if (st->entries == 0) {
+        n = varint_put(out, ts);
+        st->prev_dt = 0;
+    } else {
+        int32_t dt = (int32_t)(ts - st->prev_ts);
+        n = varint_put(out, zigzag_encode((int32_t)((uint32_t)dt - (uint32_t)st->prev_dt)));
+        st->prev_dt = dt;
+    }
+    st->prev_ts = ts;
+
+    for (int col = 0; col < SENSOR_VALUE_COUNT; col++) {
+        if (isnan(entry->values[col])) {
+            out[n++] = 0;
+            continue;
+        }
+        int32_t q = value_to_fixed(entry->values[col], col);
+        n += varint_put(out + n, zigzag_encode(q - st->prev_q[col]) + 1);
+        st->prev_q[col] = q;
+    }
+    st->entries++;
+    return n;
+}
+
+// Decode next entry of the packed sector in buf, false at end of sector or on a corrupt block
+static bool packed_decode(const uint8_t* buf, packed_state_t* st, log_entry_t* entry)
+{
+    if (st->block_left == 0) {
+        packed_block_t block;
+        st->offset = st->block_end;
+        if (st->offset + sizeof(block) > FLASH_SECTOR_SIZE) return false;
+        memcpy(&block, buf + st->offset, sizeof(block));
+        if (block.count == 0 || block.count == 0xFF ||
+            st->offset + sizeof(block) + block.length > FLASH_SECTOR_SIZE ||
+            block.crc != packed_block_crc(buf + st->offset)) {
+            return false;
+        }
+        st->offset += sizeof(block);
+        st->block_end = st->offset + block.length;
+        st->block_left = block.count;
+    }
+
+    const uint8_t* end = buf + st->block_end;
+    uint32_t code, n;
+    n = varint_get(buf + st->offset, end, &code);
+    if (n == 0) return false;
+    st->offset += n;
+
+    if (st->entries == 0) {
+        st->prev_ts = code;
+        st->prev_dt = 0;
+    } else {
+        st->prev_dt = (int32_t)((uint32_t)st->prev_dt + (uint32_t)zigzag_decode(code));
+        st->prev_ts += (uint32_t)st->prev_dt;
+    }
+    entry->timestamp = st->base_ms + st->prev_ts;
+
+    for (int col = 0; col < SENSOR_VALUE_COUNT; col++) {
+        n = varint_get(buf + st->offset, end, &code);
+        if (n == 0) return false;
+        st->offset += n;
+        if (code == 0) {
+            entry->values[col] = NAN;
+            continue;
+        }
+        st->prev_q[col] = (int32_t)((uint32_t)st->prev_q[col] + (uint32_t)zigzag_decode(code - 1));
+        entry->values[col] = (float)st->prev_q[col] / column_scale(col);
+    }
+    st->block_left--;
+    st->entries++;
+    return true;
+}
+
+static inline packed_state_t packed_sector_start(uint64_t base_ms)
+{
+    return (packed_state_t){ .offset = sizeof(sector_header_t), .block_end = sizeof(sector_header_t), .base_ms = base_ms };
+}
+
+// Find retained sector holding entry number index, binary search over sector headers
+static uint32_t locate_sector(const esp_partition_t* flash, uint32_t index)
+{
+    uint32_t lo = s_tail_seq;
+    uint32_t hi = s_staging.seq + 1;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        sector_header_t header;
+        if (log_read_sector_header(flash, mid, &header) && header.first_index <= index) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Find retained sector holding the first entry at or after time ts. Log time never decreases along
+// the log, so sector base times act as a sparse time index and the search is the one of locate_sector.
+// A base equal to ts may follow an entry stamped ts in the sector before, hence the strict compare
+static uint32_t locate_time(const esp_partition_t* flash, uint64_t ts)
+{
+    uint32_t lo = s_tail_seq;
+    uint32_t hi = s_staging.seq + 1;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        sector_header_t header;
+        if (log_read_sector_header(flash, mid, &header) && header.base_ms < ts) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool reader_load(const esp_partition_t* flash, log_reader_t* reader, uint32_t seq)
+{
+    sector_header_t header;
+    const uint8_t* data = (s_flash_map && sector_offset(seq) < flash->size) ? s_flash_map + sector_offset(seq) : s_sector_buf;
+    if (data == s_sector_buf) {
+        partition_read(flash, sector_offset(seq), s_sector_buf, FLASH_SECTOR_SIZE);
+    }
+    memcpy(&header, data, sizeof(header));
+    if (!sector_header_valid(&header) || header.seq != seq) {
+        return false;
+    }
+
+    // Sector is reclaimed before it is erased, so data read before this check is intact
+    if (seq < s_tail_seq) {
+        return false;
+    }
+
+    reader->data = data;
+    reader->seq = seq;
+    reader->magic = header.magic;
+    reader->first = header.first_index;
+    reader->index = header.first_index;
+    reader->base_ms = header.base_ms;
+    reader->end = log_read_sector_header(flash, seq + 1, &header) ? header.first_index : UINT32_MAX;
+    reader->packed = packed_sector_start(reader->base_ms);
+    return true;
+}
+
+static bool reader_decode(log_reader_t* reader, log_entry_t* entry)
+{
+    if (reader->index >= reader->end) {
+        return false;
+    }
+    if (reader->magic == LOG_SECTOR_MAGIC_PACKED) {
+        if (!packed_decode(reader->data, &reader->packed, entry)) return false;
+    } else {
+        uint32_t slot = reader->index - reader->first;
+        if (slot >= ENTRIES_PER_SECTOR) return false;
+        raw_entry_t raw;
+        memcpy(&raw, reader->data + sizeof(sector_header_t) + slot * sizeof(raw_entry_t), sizeof(raw));
+        entry->timestamp = reader->base_ms + raw.offset_ms;
+        memcpy(entry->values, raw.values, sizeof(entry->values));
+    }
+
+    // A mapped sector is read after the reclaim check in reader_load, the entry is only intact
+    // if the sector was still retained once it had been read
+    if (reader->data != s_sector_buf) {
+        __asm__ __volatile__("" ::: "memory");
+        if (reader->seq < s_tail_seq) return false;
+    }
+    reader->index++;
+    return true;
+}
+
+// Position reader at entry number index, false if its sector was reclaimed meanwhile
+bool log_reader_seek(const esp_partition_t* flash, log_reader_t* reader, uint32_t index)
+{
+    if (!reader_load(flash, reader, locate_sector(flash, index))) {
+        return false;
+    }
+    if (reader->magic == LOG_SECTOR_MAGIC_PACKED) {
+        log_entry_t entry;
+        while (reader->index < index && reader_decode(reader, &entry)) {
+        }
+    } else if (index > reader->index) {
+        reader->index = index;
+    }
+    return true;
+}
+
+// Read entry at reader position, moves on to the next sector at the end of one
+bool log_reader_next(const esp_partition_t* flash, log_reader_t* reader, log_entry_t* entry)
+{
+    while (!reader_decode(reader, entry)) {
+        if (!reader_load(flash, reader, reader->seq + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read retained entry by index, 0 is the oldest entry
+esp_err_t log_read_entry(const esp_partition_t* flash, uint32_t index, log_entry_t* entry)
+{
+    log_reader_t reader;
+    if (!log_reader_seek(flash, &reader, s_tail_first + index) || !log_reader_next(flash, &reader, entry)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
+// Slow path when no checkpoint matches: read every header and return the newest sequence number
+bool log_find_newest_sector(const esp_partition_t* flash, uint32_t* newest)
+{
+    bool found = false;
+    for (uint32_t i = 0; i < s_total_sectors; i++) {
+        sector_header_t header;
+        partition_read(flash, LOG_START + i * FLASH_SECTOR_SIZE, &header, sizeof(header));
+        if (sector_header_valid(&header) && header.seq % s_total_sectors == i &&
+            (!found || header.seq > *newest)) {
+            *newest = header.seq;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Recover tail and write head after reset or power cycle, returns number of retained entries.
+// Retained sectors hold consecutive sequence numbers, so starting from a known sector (the newest
+// checkpoint) head sector and tail sector are each a binary search (~20 reads for 1 MB). The head
+// sector is then read once and its commit records or packed blocks checked in a single pass
+static uint32_t find_num_entries(const esp_partition_t* flash, uint32_t hint_seq, log_position_t* pos)
+{
+    uint32_t ref = (hint_seq == NO_SECTOR) ? 0 : hint_seq;  // Sector 0 may predate its checkpoint
+    s_tail_seq = 0;
+    s_tail_first = 0;
+    *pos = (log_position_t){ .format = s_log_format };
+
+    // Format checkpoints the sector an empty log starts at, which is only opened with the first flush
+    if (!sector_has_seq(flash, ref) && !log_find_newest_sector(flash, &ref)) {
+        ESP_LOGI(TAG, "Log is empty");
+        s_tail_seq = (hint_seq == NO_SECTOR) ? 0 : hint_seq;
+        pos->seq = s_tail_seq;
+        return 0;
+    }
+    if (hint_seq != NO_SECTOR && ref != hint_seq) {
+        ESP_LOGW(TAG, "Checkpoint sector %lu not found, scanned all sector headers", hint_seq);
+    }
+
+    // Step 1: Newest sector, normally within CHECKPOINT_INTERVAL_SECTORS of the reference, widen if not
+    uint32_t lo = ref;
+    uint32_t end = ref + CHECKPOINT_INTERVAL_SECTORS + 1;
+    for (;;) {
+        if (end > ref + s_total_sectors) end = ref + s_total_sectors;
+        uint32_t hi = end;
+        while (hi - lo > 1) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (sector_has_seq(flash, mid)) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < end - 1 || end == ref + s_total_sectors) break;
+        end = ref + s_total_sectors;
+    }
+    uint32_t head_seq = lo;
+
+    // Step 2: Oldest sector, at most one lap behind the head
+    lo = (head_seq >= s_total_sectors - 1) ? head_seq - (s_total_sectors - 1) : 0;
+    uint32_t hi = head_seq;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (sector_has_seq(flash, mid)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    s_tail_seq = lo;
+
+    sector_header_t header;
+    log_read_sector_header(flash, s_tail_seq, &header);
+    s_tail_first = header.first_index;
+    log_read_sector_header(flash, head_seq, &header);
+
+    // Step 3: Committed entries in head sector
+    uint32_t entry_count = 0;
+    uint32_t data_end, free_end;
+    partition_read(flash, sector_offset(head_seq), s_sector_buf, FLASH_SECTOR_SIZE);
+    if (header.magic == LOG_SECTOR_MAGIC_PACKED) {
+        packed_state_t st = packed_sector_start(header.base_ms);
+        log_entry_t entry;
+        while (packed_decode(s_sector_buf, &st, &entry)) {
+        }
+        // Append after the last complete block even if it ended early
+        st.offset = st.block_end;
+        st.block_left = 0;
+        entry_count = st.entries;
+        data_end = st.offset;
+        free_end = FLASH_SECTOR_SIZE;
+        *pos = (log_position_t){ .seq = head_seq, .sector_first = header.first_index, .slot = entry_count,
+                                 .format = LOG_FORMAT_PACKED, .base_ms = header.base_ms, .opened = true, .packed = st };
+    } else {
+        uint32_t commits = 0;
+        for (;;) {
+            commit_record_t commit;
+            memcpy(&commit, s_sector_buf + FLASH_SECTOR_SIZE - (commits + 1) * sizeof(commit), sizeof(commit));
+            if (commit.end_slot <= entry_count || commit.end_slot > raw_slot_limit(commits + 1)) break;
+            const uint8_t* batch = s_sector_buf + sizeof(sector_header_t) + entry_count * sizeof(raw_entry_t);
+            if (commit.crc != commit_crc(commit.end_slot, batch, (commit.end_slot - entry_count) * sizeof(raw_entry_t))) break;
+            entry_count = commit.end_slot;
+            commits++;
+        }
+        data_end = sizeof(sector_header_t) + entry_count * sizeof(raw_entry_t);
+        free_end = FLASH_SECTOR_SIZE - commits * sizeof(commit_record_t);
+        *pos = raw_position(head_seq, header.first_index, header.base_ms, entry_count, commits);
+    }
+
+    // Anything programmed past the last commit is a write torn by a reset or power loss
+    for (uint32_t i = data_end; i < free_end && pos->seq == head_seq; i++) {
+        if (s_sector_buf[i] != 0xFF) {
+            ESP_LOGW(TAG, "Torn write after entry %lu of sector %lu", entry_count, head_seq);
+            pos->torn = true;
+            break;
+        }
+    }
+
+    uint32_t total_entries = header.first_index + entry_count - s_tail_first;
+    ESP_LOGI(TAG, "Found empty slot in sector %lu, entry %lu (sectors %lu-%lu, total: %lu)",
+             head_seq % s_total_sectors, entry_count, s_tail_seq, head_seq, total_entries);
+
+    return total_entries;
+}
+
+// Find newest valid checkpoint and next free slot, records are appended so empty slots form a suffix
+static uint32_t checkpoint_load(const esp_partition_t* flash)
+{
+    checkpoint_t cp;
+    uint32_t lo = 0;
+    uint32_t hi = CHECKPOINT_SLOTS;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        partition_read(flash, CHECKPOINT_OFFSET + mid * sizeof(checkpoint_t), &cp, sizeof(cp));
+        if (cp.seq == 0xFFFFFFFF && cp.inverted == 0xFFFFFFFF) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    s_checkpoint_slot = lo;
+    s_checkpoint_seq = NO_SECTOR;
+
+    // Newest record may be torn by power loss, fall back to the one before it
+    for (uint32_t i = lo; i > 0 && lo - i < 2; i--) {
+        partition_read(flash, CHECKPOINT_OFFSET + (i - 1) * sizeof(checkpoint_t), &cp, sizeof(cp));
+        if (cp.inverted == ~cp.seq) {
+            s_checkpoint_seq = cp.seq;
+            break;
+        }
+    }
+
+    ESP_LOGI(TAG, "Checkpoint: sector %lu (slot %lu)", s_checkpoint_seq, s_checkpoint_slot);
+    return s_checkpoint_seq;
+}
+
+// record holds seq followed by the settings bytes
+static uint32_t settings_record_crc(const uint8_t* record)
+{
+    return esp_rom_crc32_le(0, record, sizeof(uint32_t) + s_settings_size);
+}
+
+esp_err_t log_settings_load(const esp_partition_t* flash, void* settings)
+{
+    uint8_t record[SETTINGS_RECORD_SIZE(LOG_SETTINGS_MAX_SIZE)];
+    uint32_t record_size = SETTINGS_RECORD_SIZE(s_settings_size);
+    uint32_t seq, crc;
+
+    // Records are appended, so empty slots form a suffix
+    uint32_t lo = 0;
+    uint32_t hi = s_settings_slots;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        partition_read(flash, mid * record_size, &seq, sizeof(seq));
+        if (seq == 0xFFFFFFFF) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    s_settings_slot = lo;
+
+    // A torn last record falls back to the previous one
+    for (uint32_t i = lo; i > 0; i--) {
+        partition_read(flash, (i - 1) * record_size, record, record_size);
+        memcpy(&crc, record + record_size - sizeof(crc), sizeof(crc));
+        if (crc == settings_record_crc(record)) {
+            memcpy(&seq, record, sizeof(seq));
+            memcpy(settings, record + sizeof(seq), s_settings_size);
+            memcpy(s_saved_settings, settings, s_settings_size);
+            s_settings_seq = seq;
+            ESP_LOGI(TAG, "Settings record %lu (slot %lu)", seq, i - 1);
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+// Write settings into next free journal slot, slot must be available
+static esp_err_t settings_write_record(const esp_partition_t* flash, const void* settings)
+{
+    uint8_t record[SETTINGS_RECORD_SIZE(LOG_SETTINGS_MAX_SIZE)];
+    uint32_t record_size = SETTINGS_RECORD_SIZE(s_settings_size);
+    uint32_t seq = s_settings_seq + 1;
+    memcpy(record, &seq, sizeof(seq));
+    memcpy(record + sizeof(seq), settings, s_settings_size);
+    uint32_t crc = settings_record_crc(record);
+    memcpy(record + record_size - sizeof(crc), &crc, sizeof(crc));
+
+    esp_err_t err = partition_write(flash, s_settings_slot * record_size, record, record_size);
+    s_settings_slot++;
+    if (err == ESP_OK) {
+        s_settings_seq = seq;
+        memmove(s_saved_settings, settings, s_settings_size);
+    }
+    return err;
+}
+
+// Compact settings sector to newest settings record and newest checkpoint, caller must hold s_storage_mutex
+static esp_err_t settings_sector_rewrite(const esp_partition_t* flash, const void* settings)
+{
+    // Must erase sector before writing
+    esp_err_t err = wear_erase(flash, 0, WEAR_STAMP_OFFSET);
+    s_settings_slot = 0;
+    if (err == ESP_OK) {
+        err = settings_write_record(flash, settings);
+    }
+    s_checkpoint_slot = 0;
+    if (err == ESP_OK && s_checkpoint_seq != NO_SECTOR) {
+        checkpoint_t cp = { .seq = s_checkpoint_seq, .inverted = ~s_checkpoint_seq };
+        err = partition_write(flash, CHECKPOINT_OFFSET, &cp, sizeof(cp));
+        s_checkpoint_slot = 1;
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write settings sector: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+// Append checkpoint of newly opened log sector, caller must hold s_storage_mutex
+static void checkpoint_write(const esp_partition_t* flash, uint32_t seq)
+{
+    s_checkpoint_seq = seq;
+
+    if (s_checkpoint_slot >= CHECKPOINT_SLOTS) {
+        // Region full, compact to settings + newest checkpoint
+        settings_sector_rewrite(flash, s_saved_settings);
+        return;
+    }
+
+    checkpoint_t cp = { .seq = seq, .inverted = ~seq };
+    esp_err_t err = partition_write(flash, CHECKPOINT_OFFSET + s_checkpoint_slot * sizeof(checkpoint_t),
+                                        &cp, sizeof(cp));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write checkpoint: %s", esp_err_to_name(err));
+    }
+    s_checkpoint_slot++;
+}
+
+esp_err_t log_settings_save(const esp_partition_t* flash, const void* settings)
+{
+    xSemaphoreTake(s_storage_mutex, portMAX_DELAY);
+    esp_err_t err;
+    if (s_settings_slot >= s_settings_slots) {
+        err = settings_sector_rewrite(flash, settings);
+    } else {
+        err = settings_write_record(flash, settings);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write settings: %s", esp_err_to_name(err));
+        }
+    }
+    xSemaphoreGive(s_storage_mutex);
+    return err;
+}
+
+esp_err_t log_settings_reset(const esp_partition_t* flash, const void* settings)
+{
+    xSemaphoreTake(s_storage_mutex, portMAX_DELAY);
+    esp_err_t err = settings_sector_rewrite(flash, settings);
+    xSemaphoreGive(s_storage_mutex);
+    return err;
+}
+
+bool log_storage_has_log(const esp_partition_t* flash)
+{
+    for (uint32_t sector = 0; sector < s_total_sectors; sector++) {
+        sector_header_t header;
+        partition_read(flash, LOG_START + sector * FLASH_SECTOR_SIZE, &header, sizeof(header));
+        if (sector_header_valid(&header)) return true;
+    }
+    return false;
+}
+
+static inline uint32_t entry_checksum(const log_entry_t* entry)
+{
+    uint32_t words[sizeof(log_entry_t) / sizeof(uint32_t)];
+    memcpy(words, entry, sizeof(words));
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        checksum ^= words[i];
+    }
+    return checksum;
+}
+
+// Point staging buffer at a write position, entries before it are already on flash
+static void staging_reset(const log_position_t* pos)
+{
+    memset(&s_staging, 0, sizeof(s_staging));
+    s_staging.magic = STAGING_MAGIC;
+    s_staging.seq = pos->seq;
+    s_staging.sector_first = pos->sector_first;
+    s_staging.format = pos->format;
+    s_staging.opened = pos->opened;
+    s_staging.base_ms = pos->base_ms;
+
+    if (pos->format == LOG_FORMAT_PACKED) {
+        s_staging.first_slot = pos->slot;
+        s_staging.capacity = ENTRIES_PER_PAGE;
+        s_staging.packed = pos->packed;
+        return;
+    }
+
+    // Entries are batched by the flash page they end in, the sector header shifts them against page boundaries
+    uint32_t page = (sizeof(sector_header_t) + (pos->slot + 1) * sizeof(raw_entry_t) - 1) / FLASH_PAGE_SIZE;
+    uint32_t first = (page == 0) ? 0 : (page * FLASH_PAGE_SIZE - sizeof(sector_header_t)) / sizeof(raw_entry_t);
+    uint32_t end = ((page + 1) * FLASH_PAGE_SIZE - sizeof(sector_header_t)) / sizeof(raw_entry_t);
+    if (end > raw_slot_limit(pos->commits + 1)) end = raw_slot_limit(pos->commits + 1);
+
+    s_staging.commits = pos->commits;
+    s_staging.first_slot = first;
+    s_staging.capacity = end - first;
+    s_staging.count = pos->slot - first;
+    s_staging.flushed = s_staging.count;
+}
+
+// Whether the staged sector was opened, i.e. erased and given its header
+static bool staging_sector_open(void)
+{
+    return s_staging.opened;
+}
+
+// Bytes used in the staged sector
+static uint32_t staging_sector_used(void)
+{
+    if (!staging_sector_open()) return 0;
+    if (s_staging.format == LOG_FORMAT_PACKED) return s_staging.packed.offset;
+    return sizeof(sector_header_t) + (s_staging.first_slot + s_staging.flushed) * sizeof(raw_entry_t) +
+           s_staging.commits * sizeof(commit_record_t);
+}
+
+// Drop flushed entries from a packed staging buffer
+static void staging_compact(void)
+{
+    uint32_t left = s_staging.count - s_staging.flushed;
+    memmove(s_staging.entries, &s_staging.entries[s_staging.flushed], left * sizeof(log_entry_t));
+    s_staging.first_slot += s_staging.flushed;
+    s_staging.count = left;
+    s_staging.flushed = 0;
+    s_staging.checksum = 0;
+    for (uint32_t i = 0; i < left; i++) {
+        s_staging.checksum ^= entry_checksum(&s_staging.entries[i]);
+    }
+}
+
+// Format changes apply from the next opened sector, switch the staged one too while it is not on flash yet
+static void staging_apply_format(void)
+{
+    if (staging_sector_open() || s_staging.format == s_log_format) return;
+
+    uint32_t capacity = (s_log_format == LOG_FORMAT_PACKED) ? ENTRIES_PER_PAGE :
+                        (FLASH_PAGE_SIZE - sizeof(sector_header_t)) / sizeof(raw_entry_t);
+    if (s_staging.count > capacity) return;
+
+    s_staging.format = s_log_format;
+    s_staging.capacity = capacity;
+    s_staging.packed = (packed_state_t){ 0 };
+}
+
+// Keep the sector after the write head erased so flushes never wait on an erase
+static void erase_task(void* arg)
+{
+    const esp_partition_t* flash = (const esp_partition_t*)arg;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        xSemaphoreTake(s_erase_mutex, portMAX_DELAY);
+        uint32_t sector = s_erase_request;
+        if (sector != NO_SECTOR && sector != s_erased_sector) {
+            esp_err_t err = sector_erase(flash, sector);
+            if (err == ESP_OK) {
+                s_erased_sector = sector;
+                ESP_LOGD(TAG, "Pre-erased sector at offset %lu", LOG_START + sector * FLASH_SECTOR_SIZE);
+            } else {
+                ESP_LOGE(TAG, "Failed to pre-erase sector: %s", esp_err_to_name(err));
+            }
+        }
+        // A request posted for another sector during the erase stays for the next wakeup
+        portENTER_CRITICAL(&s_erase_request_lock);
+        if (s_erase_request == sector) s_erase_request = NO_SECTOR;
+        portEXIT_CRITICAL(&s_erase_request_lock);
+        xSemaphoreGive(s_erase_mutex);
+    }
+}
+
+// Make sure physical log sector is erased before its first write, waits if the erase task is on it
+static esp_err_t prepare_sector(const esp_partition_t* flash, uint32_t sector)
+{
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(s_erase_mutex, portMAX_DELAY);
+    // Got here before the erase task, it must not wipe the sector once written
+    portENTER_CRITICAL(&s_erase_request_lock);
+    if (s_erase_request == sector) s_erase_request = NO_SECTOR;
+    portEXIT_CRITICAL(&s_erase_request_lock);
+    if (s_erased_sector == sector) {
+        s_erased_sector = NO_SECTOR;
+    } else {
+        ESP_LOGI(TAG, "Erasing sector at offset %lu", LOG_START + sector * FLASH_SECTOR_SIZE);
+        err = sector_erase(flash, sector);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase sector: %s", esp_err_to_name(err));
+        }
+    }
+    xSemaphoreGive(s_erase_mutex);
+    return err;
+}
+
+// Drop oldest sector in ring mode, must happen before its physical sector is erased
+static void reclaim_oldest_sector(const esp_partition_t* flash)
+{
+    sector_header_t header;
+    s_tail_seq++;
+    s_tail_first = log_read_sector_header(flash, s_tail_seq, &header) ? header.first_index : log_end_index();
+    s_num_entries = log_end_index() - s_tail_first;
+    ESP_LOGD(TAG, "Reclaimed oldest sector, tail now %lu", s_tail_seq);
+}
+
+// Hand the next sector to the erase task once the head sector passes the fill threshold
+static void request_pre_erase(const esp_partition_t* flash)
+{
+    if (s_erase_task == NULL || !s_pre_erase) return;
+
+    bool open = staging_sector_open();
+    uint32_t next = s_staging.seq + open;
+    if (open && staging_sector_used() * 100 < FLASH_SECTOR_SIZE * PRE_ERASE_THRESHOLD_PCT) return;
+
+    if (next - s_tail_seq >= s_total_sectors) {
+        if (!s_ring_mode) return;
+        reclaim_oldest_sector(flash);
+    }
+
+    uint32_t sector = next % s_total_sectors;
+    if (s_erased_sector == sector || s_erase_request == sector) return;
+
+    portENTER_CRITICAL(&s_erase_request_lock);
+    s_erase_request = sector;
+    portEXIT_CRITICAL(&s_erase_request_lock);
+    xTaskNotifyGive(s_erase_task);
+}
+
+// Erase sector and write its header before the first entry goes into it
+static esp_err_t open_sector(const esp_partition_t* flash, uint32_t seq, uint32_t first_index, uint32_t format,
+                             uint32_t flags, uint64_t base_ms)
+{
+    if (seq - s_tail_seq >= s_total_sectors) {
+        if (!s_ring_mode) {
+            if (!s_log_full) {
+                ESP_LOGW(TAG, "Flash full!");
+                s_log_full = true;
+            }
+            return ESP_ERR_NO_MEM;
+        }
+        reclaim_oldest_sector(flash);
+    }
+
+    esp_err_t err = prepare_sector(flash, seq % s_total_sectors);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    sector_header_t header = {
+        .magic = (format == LOG_FORMAT_PACKED) ? LOG_SECTOR_MAGIC_PACKED : LOG_SECTOR_MAGIC,
+        .seq = seq,
+        .first_index = first_index,
+        .flags = flags,
+        .base_ms = base_ms
+    };
+    sector_header_stamp(flash, seq % s_total_sectors, &header);
+    header.crc = sector_header_crc(&header);
+    err = sector_head_write(flash, sector_offset(seq), &header, sizeof(header));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write sector header: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    if (seq % CHECKPOINT_INTERVAL_SECTORS == 0) {
+        checkpoint_write(flash, seq);
+    }
+    return ESP_OK;
+}
+
+// Open the sector staged entries go to
+static esp_err_t staging_open(const esp_partition_t* flash)
+{
+    // Time base is the sector's first entry, or now for a sector opened empty
+    uint64_t base_ms = (s_staging.count > 0) ? s_staging.entries[0].timestamp : log_time_ms();
+    uint32_t flags = s_staging.flags | (s_clock.wall_clock ? SECTOR_FLAG_WALL_CLOCK : 0);
+    esp_err_t err = open_sector(flash, s_staging.seq, s_staging.sector_first, s_staging.format, flags, base_ms);
+    if (err == ESP_ERR_NO_MEM) {
+        // Linear log is full, entries have nowhere to go
+        s_stats.dropped += s_staging.count - s_staging.flushed;
+        s_staging.count = s_staging.flushed;
+        s_staging.checksum = 0;
+        for (uint32_t i = 0; i < s_staging.count; i++) {
+            s_staging.checksum ^= entry_checksum(&s_staging.entries[i]);
+        }
+    } else if (err == ESP_OK) {
+        s_staging.opened = true;
+        s_staging.base_ms = base_ms;
+        s_staging.flags = 0;
+        if (s_staging.format == LOG_FORMAT_PACKED) {
+            s_staging.packed = packed_sector_start(base_ms);
+        }
+    }
+    return err;
+}
+
+static esp_err_t staging_flush(const esp_partition_t* flash);
+
+// Encode unflushed entries into one block per flush, continues in the next sector when one fills up
+static esp_err_t packed_flush(const esp_partition_t* flash)
+{
+    uint8_t block[sizeof(packed_block_t) + PACKED_BLOCK_MAX_BYTES];
+
+    while (s_staging.flushed < s_staging.count) {
+        esp_err_t err;
+        if (!s_staging.opened) {
+            err = staging_open(flash);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+
+        packed_state_t st = s_staging.packed;
+        uint32_t len = 0;
+        uint32_t n = 0;
+        while (s_staging.flushed + n < s_staging.count) {
+            uint8_t encoded[PACKED_ENTRY_MAX_BYTES];
+            packed_state_t next = st;
+            uint32_t bytes = packed_encode(&next, &s_staging.entries[s_staging.flushed + n], encoded);
+            if (len + bytes > PACKED_BLOCK_MAX_BYTES ||
+                st.offset + sizeof(packed_block_t) + len + bytes > FLASH_SECTOR_SIZE) {
+                break;
+            }
+            memcpy(block + sizeof(packed_block_t) + len, encoded, bytes);
+            st = next;
+            len += bytes;
+            n++;
+        }
+
+        if (n == 0) {
+            // Sector full, remaining entries start the next one
+            staging_compact();
+            s_staging.seq++;
+            s_staging.sector_first += s_staging.first_slot;
+            s_staging.first_slot = 0;
+            s_staging.opened = false;
+            s_staging.packed = (packed_state_t){ 0 };
+            staging_apply_format();
+            if (s_staging.format == LOG_FORMAT_RAW) {
+                return staging_flush(flash);
+            }
+            continue;
+        }
+
+        packed_block_t header = { .count = n, .length = len };
+        memcpy(block, &header, sizeof(header));
+        header.crc = packed_block_crc(block);
+        memcpy(block, &header, sizeof(header));
+        uint32_t block_offset = sector_offset(s_staging.seq) + st.offset;
+        err = partition_write(flash, block_offset, block, sizeof(header) + len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write entries: %s", esp_err_to_name(err));
+            return err;
+        }
+
+        ESP_LOGI(TAG, "Flushed %lu entries in %lu bytes at offset %lu", n, sizeof(header) + len, block_offset);
+
+        st.offset += sizeof(header) + len;
+        st.block_end = st.offset;
+        s_staging.packed = st;
+        s_staging.flushed += n;
+    }
+
+    staging_compact();
+    s_num_entries = log_end_index() - s_tail_first;
+    request_pre_erase(flash);
+    return ESP_OK;
+}
+
+// Write unflushed part of staging page in a single flash transaction, followed by its commit record
+static esp_err_t staging_flush(const esp_partition_t* flash)
+{
+    esp_err_t err = ESP_OK;
+    if (s_staging.flushed == s_staging.count) {
+        return ESP_OK;
+    }
+    if (s_staging.format == LOG_FORMAT_PACKED) {
+        return packed_flush(flash);
+    }
+
+    uint32_t slot = s_staging.first_slot + s_staging.flushed;
+    uint32_t entry_offset = slot_offset(s_staging.seq, slot);
+    uint32_t n = s_staging.count - s_staging.flushed;
+    uint32_t len = n * sizeof(raw_entry_t);
+
+    if (!s_staging.opened) {
+        err = staging_open(flash);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    // On flash timestamps are offsets from the sector base time
+    raw_entry_t batch[STAGING_SLOTS];
+    for (uint32_t i = 0; i < n; i++) {
+        const log_entry_t* entry = &s_staging.entries[s_staging.flushed + i];
+        batch[i].offset_ms = (uint32_t)(entry->timestamp - s_staging.base_ms);
+        memcpy(batch[i].values, entry->values, sizeof(batch[i].values));
+    }
+
+    err = partition_write(flash, entry_offset, batch, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write entries: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    uint16_t end_slot = s_staging.first_slot + s_staging.count;
+    commit_record_t commit = { .end_slot = end_slot,
+                               .crc = commit_crc(end_slot, batch, len) };
+    err = partition_write(flash, commit_offset(s_staging.seq, s_staging.commits), &commit, sizeof(commit));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write commit record: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Flushed %lu entries at offset %lu", n, entry_offset);
+
+    s_staging.commits++;
+    s_staging.flushed = s_staging.count;
+    s_num_entries = log_end_index() - s_tail_first;
+
+    uint32_t limit = raw_slot_limit(s_staging.commits + 1);
+    if (s_staging.count == s_staging.capacity || end_slot >= limit) {
+        log_position_t pos = raw_position(s_staging.seq, s_staging.sector_first, s_staging.base_ms, end_slot,
+                                          s_staging.commits);
+        staging_reset(&pos);
+    } else if (s_staging.first_slot + s_staging.capacity > limit) {
+        // Commit records grew into the last page
+        s_staging.capacity = limit - s_staging.first_slot;
+    }
+
+    request_pre_erase(flash);
+    return ESP_OK;
+}
+
+// Drop log sectors first..last by zeroing their magic, newest first so a reset midway still leaves
+// a consecutive run. Clearing bits needs no erase, the sectors are erased once the write head reaches them
+static void invalidate_sectors(const esp_partition_t* flash, uint32_t first, uint32_t last)
+{
+    const uint32_t magic = 0;
+    for (uint32_t seq = last + 1; seq-- > first; ) {
+        if (!sector_has_seq(flash, seq)) continue;
+        esp_err_t err = partition_write(flash, sector_offset(seq), &magic, sizeof(magic));
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to drop sector %lu: %s", seq, esp_err_to_name(err));
+        }
+    }
+}
+
+// Cut head sector seq at target in place, for when every other sector holds retained entries. The
+// part before the cut is copied through s_sector_buf, the sector erased and written back. Raw entries
+// kept get a single commit record, packed blocks are copied whole and entries of the block holding
+// the cut go back into staging to be re-encoded. Everything kept is read and decoded before the erase,
+// a read or decode error leaves the sector alone. A power loss between erase and rewrite loses the sector
+static esp_err_t sector_rewrite(const esp_partition_t* flash, uint32_t seq, const sector_header_t* header, uint32_t target)
+{
+    esp_err_t err = partition_read(flash, sector_offset(seq), s_sector_buf, FLASH_SECTOR_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read sector to rewrite: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    uint32_t slot = target - header->first_index;
+    log_position_t pos = raw_position(seq, header->first_index, header->base_ms, slot, slot > 0 ? 1 : 0);
+    uint32_t keep_bytes = sizeof(sector_header_t) + slot * sizeof(raw_entry_t);
+    packed_state_t block_start = packed_sector_start(header->base_ms);
+    uint32_t partial = 0;
+
+    if (header->magic == LOG_SECTOR_MAGIC_PACKED) {
+        // Entries of the block holding the cut are kept as they decode, a block never holds more
+        // than staging does
+        packed_state_t st = block_start;
+        for (uint32_t i = 0; i < slot; i++) {
+            if (st.block_left == 0) block_start = st;
+            partial = st.entries - block_start.entries;
+            if (partial >= STAGING_SLOTS || !packed_decode(s_sector_buf, &st, &s_rewrite_entries[partial])) {
+                ESP_LOGE(TAG, "Sector %lu does not decode up to the cut, not rewritten", seq);
+                return ESP_ERR_INVALID_CRC;
+            }
+        }
+        if (st.block_left == 0) block_start = st;
+        partial = st.entries - block_start.entries;
+        block_start.offset = block_start.block_end;
+        pos = (log_position_t){ .seq = seq, .sector_first = header->first_index, .slot = block_start.entries,
+                                .format = LOG_FORMAT_PACKED, .opened = true, .base_ms = header->base_ms,
+                                .packed = block_start };
+        keep_bytes = block_start.offset;
+    }
+
+    err = prepare_sector(flash, seq % s_total_sectors);
+    if (err == ESP_OK) {
+        // Header copy carries the count of the erase before, take the one just stamped
+        sector_header_t fresh = *header;
+        sector_header_stamp(flash, seq % s_total_sectors, &fresh);
+        fresh.crc = sector_header_crc(&fresh);
+        memcpy(s_sector_buf, &fresh, sizeof(fresh));
+        err = sector_head_write(flash, sector_offset(seq), s_sector_buf, keep_bytes);
+    }
+    if (err == ESP_OK && header->magic == LOG_SECTOR_MAGIC && slot > 0) {
+        commit_record_t commit = { .end_slot = slot,
+                                   .crc = commit_crc(slot, s_sector_buf + sizeof(sector_header_t), slot * sizeof(raw_entry_t)) };
+        err = partition_write(flash, commit_offset(seq, 0), &commit, sizeof(commit));
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to rewrite sector: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    staging_reset(&pos);
+    memcpy(s_staging.entries, s_rewrite_entries, partial * sizeof(log_entry_t));
+    for (uint32_t i = 0; i < partial; i++) {
+        s_staging.checksum ^= entry_checksum(&s_staging.entries[i]);
+    }
+    s_staging.count = partial;
+    s_num_entries = target - s_tail_first;
+    return staging_flush(flash);
+}
+
+// Move write head back to entry number target, entries after it are removed from flash. A sector
+// holds entries up to where the next one starts, so the cut is made durable by opening a fresh
+// sector at target, after dropping the sectors past it. The sector holding the cut keeps its
+// now unreachable entries until it is reused
+static esp_err_t staging_truncate(const esp_partition_t* flash, uint32_t target)
+{
+    sector_header_t header;
+    uint32_t seq = locate_sector(flash, target);
+    log_read_sector_header(flash, seq, &header);
+    uint32_t newest = s_staging.seq - !staging_sector_open();
+
+    uint32_t next = (target == header.first_index) ? seq : seq + 1;
+    if (next - s_tail_seq >= s_total_sectors) {
+        // Opening another sector would reclaim the oldest one, cut this one instead
+        return sector_rewrite(flash, seq, &header, target);
+    }
+
+    invalidate_sectors(flash, next, newest);
+    staging_reset(&(log_position_t){ .seq = next, .sector_first = target, .format = s_log_format });
+    s_num_entries = target - s_tail_first;
+    esp_err_t err = staging_open(flash);
+
+    // Newest checkpoint may point at a dropped sector, boot would fall back to a full header scan
+    if (err == ESP_OK && s_checkpoint_seq != NO_SECTOR && s_checkpoint_seq > next) {
+        checkpoint_write(flash, next);
+    }
+    request_pre_erase(flash);
+    return err;
+}
+
+// Commit entries left in RTC staging buffer by a brownout or software reset, pos is the recovered write head
+static void staging_recover(const esp_partition_t* flash, const log_position_t* pos)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool valid = reason != ESP_RST_POWERON && reason != ESP_RST_UNKNOWN &&
+                 s_staging.magic == STAGING_MAGIC &&
+                 s_staging.capacity <= STAGING_SLOTS &&
+                 s_staging.count <= s_staging.capacity &&
+                 s_staging.flushed <= s_staging.count &&
+                 s_staging.seq == pos->seq &&
+                 s_staging.sector_first == pos->sector_first &&
+                 s_staging.first_slot + s_staging.flushed == pos->slot &&
+                 (pos->slot == 0 || s_staging.format == pos->format) &&
+                 (!pos->opened || s_staging.base_ms == pos->base_ms) &&
+                 (s_staging.format != LOG_FORMAT_RAW || s_staging.commits == pos->commits) &&
+                 (s_staging.format != LOG_FORMAT_PACKED || s_staging.packed.offset == pos->packed.offset);
+
+    if (valid) {
+        uint32_t checksum = 0;
+        for (uint32_t i = 0; i < s_staging.count; i++) {
+            checksum ^= entry_checksum(&s_staging.entries[i]);
+        }
+        valid = checksum == s_staging.checksum;
+    }
+
+    // A torn write can only be completed by writing the same bytes again, which only the staged entries can
+    if (pos->torn && (!valid || s_staging.count == s_staging.flushed)) {
+        ESP_LOGW(TAG, "Discarding torn write, continuing in next sector");
+        staging_reset(&(log_position_t){ .seq = pos->seq + 1, .sector_first = pos->sector_first + pos->slot,
+                                         .format = s_log_format });
+        s_num_entries = log_end_index() - s_tail_first;
+        return;
+    }
+
+    if (!valid) {
+        staging_reset(pos);
+        s_num_entries = log_end_index() - s_tail_first;
+        return;
+    }
+
+    // Flash knows best whether the header made it out before the reset
+    s_staging.opened = pos->opened;
+    if (s_staging.count > s_staging.flushed) {
+        uint32_t pending = s_staging.count - s_staging.flushed;
+        if (staging_flush(flash) == ESP_OK) {
+            ESP_LOGW(TAG, "Recovered %lu unflushed entries after reset (reason %d)", pending, reason);
+        }
+    }
+    s_num_entries = log_end_index() - s_tail_first;
+}
+
+// Log time of the newest entry, or of an empty head sector opened after it. 0 for an empty log
+static uint64_t log_newest_ms(const esp_partition_t* flash)
+{
+    uint64_t newest_ms = s_staging.opened ? s_staging.base_ms : 0;
+    log_entry_t last;
+    if (s_staging.count > s_staging.flushed) {
+        last = s_staging.entries[s_staging.count - 1];  // Flushed ones may only be placeholders of a raw page
+    } else if (s_num_entries == 0 || log_read_entry(flash, s_num_entries - 1, &last) != ESP_OK) {
+        return newest_ms;
+    }
+    return (last.timestamp > newest_ms) ? last.timestamp : newest_ms;
+}
+
+// Start a new sector at the next entry, flags go into its header. A sector has a single time base,
+// so a jump in log time (or offsets outgrowing 32 bits) cannot continue the current one
+static void staging_splice(const esp_partition_t* flash, uint32_t flags)
+{
+    staging_flush(flash);
+    if (s_staging.count > s_staging.flushed) {
+        return;  // Flash failing, entries keep their old sector
+    }
+    if (s_staging.opened) {
+        staging_reset(&(log_position_t){ .seq = s_staging.seq + 1, .sector_first = log_end_index(),
+                                         .format = s_log_format });
+    }
+    s_staging.flags = flags;
+}
+
+// Pick up log time after a reset. Resets that keep the system clock running continue it exactly,
+// otherwise the log continues DATA_SPLICE_GAP_MS after its newest entry in a sector marked as splice
+void log_clock_restore(const esp_partition_t* flash)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    uint64_t newest_ms = log_newest_ms(flash);
+    if (s_clock.magic == CLOCK_MAGIC && reason != ESP_RST_POWERON && reason != ESP_RST_UNKNOWN &&
+        log_time_ms() >= newest_ms) {
+        ESP_LOGI(TAG, "Log time continues at %llu ms", (unsigned long long)log_time_ms());
+        return;
+    }
+
+    bool splice = newest_ms > 0 || s_num_entries > 0;
+    uint64_t start_ms = splice ? newest_ms + DATA_SPLICE_GAP_MS : rtc_time_ms();
+    s_clock = (log_clock_t){ .magic = CLOCK_MAGIC, .wall_clock = 0, .offset_ms = start_ms - rtc_time_ms() };
+    if (splice) {
+        staging_splice(flash, SECTOR_FLAG_SPLICE);
+        ESP_LOGI(TAG, "Last timestamp: %llu ms, splice continues at %llu ms",
+                 (unsigned long long)newest_ms, (unsigned long long)start_ms);
+    }
+}
+
+// Stage entry in RAM, flash is only written once a page is full
+esp_err_t log_data_entry(const esp_partition_t* flash, log_entry_t* entry)
+{
+    if (s_staging.count == s_staging.capacity) {
+        // Previous flush of full page failed, retry before accepting more
+        esp_err_t err = staging_flush(flash);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    uint64_t base_ms = s_staging.opened ? s_staging.base_ms :
+                       (s_staging.count > 0) ? s_staging.entries[0].timestamp : entry->timestamp;
+    if (entry->timestamp - base_ms > UINT32_MAX) {
+        staging_splice(flash, s_staging.flags);
+    }
+
+    if (s_staging.count == s_staging.flushed) {
+        s_staging_oldest_us = esp_timer_get_time();
+    }
+
+    s_staging.entries[s_staging.count] = *entry;
+    s_staging.checksum ^= entry_checksum(entry);
+    s_staging.count++;
+
+    if (s_staging.count == s_staging.capacity) {
+        return staging_flush(flash);
+    }
+    return ESP_OK;
+}
+
+uint32_t log_scan(const esp_partition_t* flash, uint32_t pos, uint32_t end, uint64_t from_ms, uint64_t to_ms,
+                  entry_visitor_t visit, void* ctx)
+{
+    log_reader_t reader;
+    bool ok = pos < end && log_reader_seek(flash, &reader, pos);
+    if (ok) pos = reader.index;
+    uint32_t count = 0;
+    while (pos < end) {
+        log_entry_t entry;
+        if (!ok || !log_reader_next(flash, &reader, &entry)) {
+            if (s_tail_first <= pos) break;
+            pos = s_tail_first;
+            ok = log_reader_seek(flash, &reader, pos);
+            if (ok) pos = reader.index;
+            continue;
+        }
+        pos = reader.index;
+        if (entry.timestamp < from_ms) continue;
+        if (entry.timestamp > to_ms) break;
+        count++;
+        visit(&entry, ctx);
+    }
+    return count;
+}
+
+uint32_t log_locate_time(const esp_partition_t* flash, uint32_t pos, uint32_t end, uint64_t from_ms)
+{
+    sector_header_t header;
+    if (pos < end && log_read_sector_header(flash, locate_time(flash, from_ms), &header) && header.first_index > pos) {
+        return header.first_index;
+    }
+    return pos;
+}
+
+esp_err_t log_storage_add_backend(const log_backend_t* backend)
+{
+    if (s_total_sectors != 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (backend->size == 0 || backend->size % FLASH_SECTOR_SIZE != 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (s_num_backends == LOG_MAX_BACKENDS) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_backends[s_num_backends++] = *backend;
+    return ESP_OK;
+}
+
+static esp_err_t backend_partition_read(void* ctx, uint32_t offset, void* dst, size_t len)
+{
+    return esp_partition_read((const esp_partition_t*)ctx, offset, dst, len);
+}
+
+static esp_err_t backend_partition_write(void* ctx, uint32_t offset, const void* src, size_t len)
+{
+    return esp_partition_write((const esp_partition_t*)ctx, offset, src, len);
+}
+
+static esp_err_t backend_partition_erase(void* ctx, uint32_t offset, size_t len)
+{
+    return esp_partition_erase_range((const esp_partition_t*)ctx, offset, len);
+}
+
+void log_backend_partition(const esp_partition_t* partition, log_backend_t* backend)
+{
+    *backend = (log_backend_t){ .read = backend_partition_read, .write = backend_partition_write,
+                                .erase = backend_partition_erase,
+                                .size = partition->size / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE,
+                                .ctx = (void*)partition };
+}
+
+esp_err_t log_storage_init(const esp_partition_t* flash, size_t settings_size)
+{
+    // Offsets of the partition and backends together must fit 32 bits
+    uint64_t space = flash->size;
+    for (uint32_t i = 0; i < s_num_backends; i++) {
+        space += s_backends[i].size;
+    }
+    if (flash->size < LOG_START + FLASH_SECTOR_SIZE || flash->size % FLASH_SECTOR_SIZE != 0 || space > UINT32_MAX ||
+        settings_size > LOG_SETTINGS_MAX_SIZE) {
+        ESP_LOGE(TAG, "Partition of %lu bytes, %llu bytes of log space or settings of %u bytes do not fit",
+                 flash->size, space, (unsigned)settings_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    // Headers are cleared in place and records written in pieces smaller than the 16-byte blocks
+    // flash encryption writes, neither works on an encrypted partition
+    if (flash->encrypted) {
+        ESP_LOGE(TAG, "Partition %s is encrypted, the log needs a plain one", flash->label);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    s_total_sectors = (space - LOG_START) / FLASH_SECTOR_SIZE;
+    s_settings_size = settings_size;
+    s_settings_slots = CHECKPOINT_OFFSET / SETTINGS_RECORD_SIZE(settings_size);
+
+    // Sector erases are serialized with the pre-erase task, needed from first flash write on
+    s_erase_mutex = xSemaphoreCreateMutex();
+    s_storage_mutex = xSemaphoreCreateMutex();
+    if (!s_erase_mutex || !s_storage_mutex) {
+        ESP_LOGE(TAG, "Failed to allocate storage locks");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t log_storage_start(const esp_partition_t* flash, uint32_t erase_task_priority)
+{
+    if (xTaskCreate(erase_task, "erase", 4096, (void*)flash, erase_task_priority, &s_erase_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start erase task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void log_storage_lock(void)
+{
+    xSemaphoreTake(s_storage_mutex, portMAX_DELAY);
+}
+
+void log_storage_unlock(void)
+{
+    xSemaphoreGive(s_storage_mutex);
+}
+
+esp_err_t log_storage_format(const esp_partition_t* flash, const void* settings)
+{
+    // Log sectors are not erased here, their headers are dropped like clear does and each sector is
+    // erased once the write head reaches it, so a reset costs no erases beyond the ones logging needs.
+    // The log starts at the least-worn sector, so short logs between resets do not keep wearing the
+    // same ones. Headers go before the settings, a power loss midway keeps settings that still match
+    const uint32_t magic = 0;
+    uint32_t start = 0;
+    uint32_t start_count = UINT32_MAX;
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(s_erase_mutex, portMAX_DELAY);
+    for (uint32_t sector = 0; sector < s_total_sectors && err == ESP_OK; sector++) {
+        uint32_t offset = LOG_START + sector * FLASH_SECTOR_SIZE;
+        sector_header_t header;
+        partition_read(flash, offset, &header, sizeof(header));
+        if (sector_header_valid(&header)) {
+            err = partition_write(flash, offset, &magic, sizeof(magic));
+        }
+        uint32_t count = wear_read(flash, sector_wear_offset(sector));
+        if (count < start_count) {
+            start = sector;
+            start_count = count;
+        }
+    }
+    if (err == ESP_OK) {
+        err = wear_erase(flash, 0, WEAR_STAMP_OFFSET);
+    }
+    // Recovery of the empty log finds an erased start sector, the first open does not erase it again
+    if (err == ESP_OK) {
+        err = sector_erase(flash, start);
+    }
+    s_erased_sector = (err == ESP_OK) ? start : NO_SECTOR;
+    xSemaphoreGive(s_erase_mutex);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    s_settings_slot = 0;
+    s_settings_seq = 0;
+    err = settings_write_record(flash, settings);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    s_num_entries = 0;
+    s_tail_seq = start;
+    s_tail_first = 0;
+    s_ring_mode = false;
+    s_log_full = false;
+    s_checkpoint_slot = 0;
+    s_checkpoint_seq = NO_SECTOR;
+    s_log_format = LOG_FORMAT_RAW;
+    staging_reset(&(log_position_t){ .seq = start, .format = s_log_format });
+
+    // Boot finds an empty log through the checkpoint, sector start has no header yet
+    checkpoint_write(flash, start);
+    ESP_LOGI(TAG, "Log starts at sector %lu, erased %lu times", start, start_count + 1);
+    return ESP_OK;
+}
+
+uint32_t log_storage_recover(const esp_partition_t* flash, bool ring_mode, uint8_t format)
+{
+    s_ring_mode = ring_mode;
+    s_log_format = format;
+
+    log_position_t head;
+    find_num_entries(flash, checkpoint_load(flash), &head);
+    staging_recover(flash, &head);
+    return s_num_entries;
+}
+
+void log_storage_suspend(log_storage_state_t* state)
+{
+    xSemaphoreTake(s_erase_mutex, portMAX_DELAY);  // Never sleep in the middle of a background erase
+
+    *state = (log_storage_state_t){
+        .num_entries = s_num_entries,
+        .tail_seq = s_tail_seq,
+        .tail_first = s_tail_first,
+        .erased_sector = s_erased_sector,
+        .settings_slot = s_settings_slot,
+        .settings_seq = s_settings_seq,
+        .checkpoint_slot = s_checkpoint_slot,
+        .checkpoint_seq = s_checkpoint_seq,
+        .dropped = s_stats.dropped,
+        .log_full = s_log_full
+    };
+}
+
+void log_storage_resume(const log_storage_state_t* state, const void* settings, bool ring_mode, uint8_t format)
+{
+    s_num_entries = state->num_entries;
+    s_tail_seq = state->tail_seq;
+    s_tail_first = state->tail_first;
+    s_erased_sector = state->erased_sector;
+    s_settings_slot = state->settings_slot;
+    s_settings_seq = state->settings_seq;
+    memcpy(s_saved_settings, settings, s_settings_size);
+    s_checkpoint_slot = state->checkpoint_slot;
+    s_checkpoint_seq = state->checkpoint_seq;
+    s_ring_mode = ring_mode;
+    s_log_format = format;
+    s_log_full = state->log_full;
+    s_stats.dropped = state->dropped;
+}
+
+bool log_clock_is_wall(void)
+{
+    return s_clock.wall_clock;
+}
+
+esp_err_t log_set_time(const esp_partition_t* flash, uint64_t time_ms, uint64_t* newest_ms)
+{
+    *newest_ms = log_newest_ms(flash);
+    if (time_ms <= *newest_ms) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct timeval tv = { .tv_sec = (time_t)(time_ms / 1000), .tv_usec = (suseconds_t)(time_ms % 1000) * 1000 };
+    settimeofday(&tv, NULL);
+    s_clock = (log_clock_t){ .magic = CLOCK_MAGIC, .wall_clock = 1, .offset_ms = 0 };
+    staging_splice(flash, SECTOR_FLAG_SPLICE);
+    return ESP_OK;
+}
+
+esp_err_t log_flush(const esp_partition_t* flash)
+{
+    esp_err_t err = staging_flush(flash);
+    if (err != ESP_OK) {
+        s_staging_oldest_us = esp_timer_get_time();  // Back off instead of retrying in a tight loop
+    }
+    return err;
+}
+
+uint32_t log_flush_wait_ms(void)
+{
+    if (s_staging.count == s_staging.flushed) {
+        return UINT32_MAX;
+    }
+    int64_t age_ms = (esp_timer_get_time() - s_staging_oldest_us) / 1000;
+    return (age_ms >= FLUSH_MAX_LATENCY_MS) ? 0 : (uint32_t)(FLUSH_MAX_LATENCY_MS - age_ms);
+}
+
+esp_err_t log_truncate(const esp_partition_t* flash, uint32_t count)
+{
+    s_log_full = false;
+    return staging_truncate(flash, log_end_index() - count);
+}
+
+void log_set_ring_mode(bool ring_mode)
+{
+    s_ring_mode = ring_mode;
+    s_log_full = false;
+}
+
+void log_set_format(uint8_t format)
+{
+    s_log_format = format;
+    staging_apply_format();
+}
+
+uint32_t log_storage_count(void)
+{
+    return s_num_entries;
+}
+
+uint32_t log_storage_first(void)
+{
+    return s_tail_first;
+}
+
+uint32_t log_storage_pending(void)
+{
+    return s_staging.count - s_staging.flushed;
+}
+
+uint32_t log_storage_used_bytes(void)
+{
+    return (s_staging.seq - s_tail_seq) * FLASH_SECTOR_SIZE + staging_sector_used();
+}
+
+uint32_t log_storage_size_bytes(void)
+{
+    return s_total_sectors * FLASH_SECTOR_SIZE;
+}
+
+void log_storage_sectors(uint32_t* tail_seq, uint32_t* head_seq)
+{
+    *tail_seq = s_tail_seq;
+    *head_seq = s_staging.seq;
+}
+
+void log_storage_wear(const esp_partition_t* flash, log_wear_t* wear)
+{
+    uint64_t sum = 0;
+    *wear = (log_wear_t){ .min = UINT32_MAX, .settings = wear_read(flash, WEAR_STAMP_OFFSET) };
+    for (uint32_t i = 0; i < s_total_sectors; i++) {
+        uint32_t count = wear_read(flash, sector_wear_offset(i));
+        if (count < wear->min) wear->min = count;
+        if (count > wear->max) wear->max = count;
+        sum += count;
+    }
+    wear->mean = (float)sum / s_total_sectors;
+}
+
+bool log_storage_use_map(bool mapped)
+{
+    s_flash_map = mapped ? s_flash_map_base : NULL;
+    return s_flash_map_base != NULL;
+}
+
+void log_storage_set_pre_erase(bool enabled)
+{
+    s_pre_erase = enabled;
+}
+
+log_storage_stats_t* log_storage_get_stats(void)
+{
+    return &s_stats;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "stats.h"
+
+// Compile-time table of sensor channels. Every enabled driver becomes one column per statistic of
+// the log record, in the order below, so the record only holds the channels a board actually has
+
+#define SENSOR_ENABLE_INTERNAL_TEMP 1   // ESP32-S2 internal temperature sensor, degrees C
+#define SENSOR_ENABLE_ADC 0             // ADC1 oneshot voltage, millivolts
+#define SENSOR_ENABLE_LM75 0            // LM75/TMP102-compatible I2C temperature sensor, degrees C
+
+#define SENSOR_CHANNEL_COUNT (SENSOR_ENABLE_INTERNAL_TEMP + SENSOR_ENABLE_ADC + SENSOR_ENABLE_LM75)
+
+// Burst sampling reads each due channel several times per logging period and stores aggregates.
+// Every enabled statistic is a column per channel, mean only keeps the plain single-value layout
+#define SENSOR_STAT_MEAN 1
+#define SENSOR_STAT_MIN 0
+#define SENSOR_STAT_MAX 0
+#define SENSOR_STAT_STDDEV 0            // Population standard deviation of the burst
+
+#define SENSOR_STAT_COUNT (SENSOR_STAT_MEAN + SENSOR_STAT_MIN + SENSOR_STAT_MAX + SENSOR_STAT_STDDEV)
+#define SENSOR_VALUE_COUNT (SENSOR_CHANNEL_COUNT * SENSOR_STAT_COUNT)
+
+#define SENSOR_DEFAULT_BURST 1          // Reads per logging period, 1 disables burst sampling
+#define SENSOR_MAX_BURST 64
+
+#define SENSOR_ADC_CHANNEL 0            // ADC1 channel, GPIO1 on ESP32-S2
+#define SENSOR_ADC_DECIMATION 10        // Default: slow channel, sampled every 10th period
+
+#define SENSOR_I2C_PORT 0
+#define SENSOR_I2C_SDA_PIN 8
+#define SENSOR_I2C_SCL_PIN 9
+#define SENSOR_LM75_ADDR 0x48
+
+#define SENSOR_MAX_DECIMATION 255
+
+#if SENSOR_CHANNEL_COUNT == 0
+#error "Enable at least one sensor channel in sensors.h"
+#endif
+#if SENSOR_STAT_COUNT == 0
+#error "Enable at least one burst statistic in sensors.h"
+#endif
+
+typedef struct {
+    const char* name;         // CSV column name
+    const char* unit;         // Appended to column name
+    uint8_t decimals;         // Resolution kept by the packed log format and printed by dump
+    uint8_t decimation;       // Default: sample on every Nth logging period
+    esp_err_t (*init)(void);
+    esp_err_t (*read)(float* value);
+} sensor_driver_t;
+
+extern const sensor_driver_t sensor_drivers[SENSOR_CHANNEL_COUNT];
+
+// Record column col holds statistic col % SENSOR_STAT_COUNT of channel col / SENSOR_STAT_COUNT
+static inline const sensor_driver_t* sensors_column_driver(int col)
+{
+    return &sensor_drivers[col / SENSOR_STAT_COUNT];
+}
+
+/**
+ * @brief Initialize every channel in the table
+ *
+ * A channel that fails to initialize is logged and reads as not sampled, the others keep working.
+ *
+ * @return ESP_OK if all channels initialized, error of the first failing channel otherwise
+ */
+esp_err_t sensors_init(void);
+
+/**
+ * @brief Sample channels due on this logging period
+ *
+ * Channel ch is read burst times back to back when tick is a multiple of decimation[ch], and the
+ * enabled statistics over the reads that succeeded are stored. Channels not due, and channels
+ * without a single successful read, are set to NAN.
+ *
+ * @param tick Logging periods since sampling started
+ * @param decimation Per-channel decimation, SENSOR_CHANNEL_COUNT entries
+ * @param burst Reads per channel, 0 is treated as 1
+ * @param values Output, SENSOR_VALUE_COUNT entries
+ */
+void sensors_read(uint32_t tick, const uint8_t* decimation, uint8_t burst, float* values);
+
+/**
+ * @brief CSV column name of record column col, e.g. "temperature_C" or "temperature_C_max"
+ *
+ * @return Length written, as snprintf
+ */
+int sensors_column_name(int col, char* buf, size_t size);
+
+/**
+ * @brief Identifier of the channel table, changes whenever channels are added, removed or reordered
+ *
+ * Stored alongside the log so a firmware with a different table does not misread old records.
+ */
+uint32_t sensors_layout_id(void);
+
+// Read latency of channel ch, one record per driver read call including every burst read
+stats_op_t* sensors_read_stats(int ch);
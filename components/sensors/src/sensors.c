@@ -0,0 +1,287 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "sensors.h"
+
+#if SENSOR_ENABLE_INTERNAL_TEMP
+#include "driver/temperature_sensor.h"
+#endif
+#if SENSOR_ENABLE_ADC
+#include "esp_adc/adc_oneshot.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+#endif
+#if SENSOR_ENABLE_LM75
+#include "driver/i2c_master.h"
+#endif
+
+static const char *TAG = "sensors";
+
+#define I2C_TIMEOUT_MS 50
+
+static stats_op_t s_read_stats[SENSOR_CHANNEL_COUNT];  // Time per driver read call
+
+#if SENSOR_ENABLE_INTERNAL_TEMP
+static temperature_sensor_handle_t s_temp_sensor = NULL;
+
+static esp_err_t internal_temp_init(void)
+{
+    temperature_sensor_config_t temp_config = {
+        .range_min = -10,
+        .range_max = 80,
+        .clk_src = 0
+    };
+
+    esp_err_t err = temperature_sensor_install(&temp_config, &s_temp_sensor);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return temperature_sensor_enable(s_temp_sensor);
+}
+
+static esp_err_t internal_temp_read(float* value)
+{
+    return temperature_sensor_get_celsius(s_temp_sensor, value);
+}
+#endif
+
+#if SENSOR_ENABLE_ADC
+static adc_oneshot_unit_handle_t s_adc = NULL;
+static adc_cali_handle_t s_adc_cali = NULL;  // NULL if the chip has no calibration data, raw counts are logged then
+
+static esp_err_t adc_init(void)
+{
+    adc_oneshot_unit_init_cfg_t unit_config = { .unit_id = ADC_UNIT_1 };
+    esp_err_t err = adc_oneshot_new_unit(&unit_config, &s_adc);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    adc_oneshot_chan_cfg_t chan_config = { .atten = ADC_ATTEN_DB_12, .bitwidth = ADC_BITWIDTH_DEFAULT };
+    err = adc_oneshot_config_channel(s_adc, SENSOR_ADC_CHANNEL, &chan_config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    adc_cali_line_fitting_config_t cali_config = {
+        .unit_id = ADC_UNIT_1,
+        .atten = ADC_ATTEN_DB_12,
+        .bitwidth = ADC_BITWIDTH_DEFAULT
+    };
+    if (adc_cali_create_scheme_line_fitting(&cali_config, &s_adc_cali) != ESP_OK) {
+        ESP_LOGW(TAG, "No ADC calibration, logging raw counts");
+        s_adc_cali = NULL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t adc_read(float* value)
+{
+    int raw, mv;
+    esp_err_t err = adc_oneshot_read(s_adc, SENSOR_ADC_CHANNEL, &raw);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (s_adc_cali == NULL || adc_cali_raw_to_voltage(s_adc_cali, raw, &mv) != ESP_OK) {
+        mv = raw;
+    }
+    *value = (float)mv;
+    return ESP_OK;
+}
+#endif
+
+#if SENSOR_ENABLE_LM75
+static i2c_master_bus_handle_t s_i2c_bus = NULL;
+static i2c_master_dev_handle_t s_lm75 = NULL;
+
+static esp_err_t lm75_init(void)
+{
+    i2c_master_bus_config_t bus_config = {
+        .i2c_port = SENSOR_I2C_PORT,
+        .sda_io_num = SENSOR_I2C_SDA_PIN,
+        .scl_io_num = SENSOR_I2C_SCL_PIN,
+        .clk_source = I2C_CLK_SRC_DEFAULT,
+        .glitch_ignore_cnt = 7,
+        .flags.enable_internal_pullup = true
+    };
+    esp_err_t err = i2c_new_master_bus(&bus_config, &s_i2c_bus);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    i2c_device_config_t dev_config = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = SENSOR_LM75_ADDR,
+        .scl_speed_hz = 100000
+    };
+    return i2c_master_bus_add_device(s_i2c_bus, &dev_config, &s_lm75);
+}
+
+static esp_err_t lm75_read(float* value)
+{
+    // Temperature register 0, left-aligned two's complement, top 11 bits valid in 0.125 C steps
+    uint8_t reg = 0;
+    uint8_t data[2];
+    esp_err_t err = i2c_master_transmit_receive(s_lm75, &reg, 1, data, sizeof(data), I2C_TIMEOUT_MS);
+    if (err != ESP_OK) {
+        return err;
+    }
+    int16_t raw = (int16_t)((data[0] << 8) | data[1]);
+    *value = (raw >> 5) * 0.125f;
+    return ESP_OK;
+}
+#endif
+
+const sensor_driver_t sensor_drivers[SENSOR_CHANNEL_COUNT] = {
+#if SENSOR_ENABLE_INTERNAL_TEMP
+    { .name = "temperature", .unit = "C", .decimals = 2, .decimation = 1,
+      .init = internal_temp_init, .read = internal_temp_read },
+#endif
+#if SENSOR_ENABLE_ADC
+    { .name = "voltage", .unit = "mV", .decimals = 0, .decimation = SENSOR_ADC_DECIMATION,
+      .init = adc_init, .read = adc_read },
+#endif
+#if SENSOR_ENABLE_LM75
+    { .name = "lm75", .unit = "C", .decimals = 3, .decimation = 1,
+      .init = lm75_init, .read = lm75_read },
+#endif
+};
+
+// Column suffixes in record order, left out when mean is the only statistic
+static const char* const s_stat_names[SENSOR_STAT_COUNT] = {
+#if SENSOR_STAT_MEAN
+    "mean",
+#endif
+#if SENSOR_STAT_MIN
+    "min",
+#endif
+#if SENSOR_STAT_MAX
+    "max",
+#endif
+#if SENSOR_STAT_STDDEV
+    "std",
+#endif
+};
+
+static esp_err_t s_init_err[SENSOR_CHANNEL_COUNT];
+
+esp_err_t sensors_init(void)
+{
+    esp_err_t result = ESP_OK;
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        s_init_err[ch] = sensor_drivers[ch].init();
+        if (s_init_err[ch] != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to init %s sensor: %s", sensor_drivers[ch].name, esp_err_to_name(s_init_err[ch]));
+            if (result == ESP_OK) result = s_init_err[ch];
+        }
+    }
+    return result;
+}
+
+// Running burst statistics of one channel, Welford's update keeps the variance stable in float
+typedef struct {
+    uint32_t count;
+    float mean;
+    float m2;
+    float min;
+    float max;
+} burst_stats_t;
+
+static void stats_add(burst_stats_t* st, float value)
+{
+    st->count++;
+    float delta = value - st->mean;
+    st->mean += delta / st->count;
+    st->m2 += delta * (value - st->mean);
+    if (st->count == 1 || value < st->min) st->min = value;
+    if (st->count == 1 || value > st->max) st->max = value;
+}
+
+void sensors_read(uint32_t tick, const uint8_t* decimation, uint8_t burst, float* values)
+{
+    burst_stats_t stats[SENSOR_CHANNEL_COUNT] = { 0 };
+    esp_err_t errors[SENSOR_CHANNEL_COUNT];
+    bool due[SENSOR_CHANNEL_COUNT];
+
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        due[ch] = s_init_err[ch] == ESP_OK && decimation[ch] != 0 && tick % decimation[ch] == 0;
+        errors[ch] = ESP_OK;
+    }
+
+    // Channels interleaved per read, so the aggregates of all channels cover the same time span
+    if (burst == 0) burst = 1;
+    for (int i = 0; i < burst; i++) {
+        for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+            if (!due[ch]) continue;
+            float value;
+            int64_t start_us = stats_begin();
+            esp_err_t err = sensor_drivers[ch].read(&value);
+            stats_end(&s_read_stats[ch], start_us);
+            if (err == ESP_OK) {
+                stats_add(&stats[ch], value);
+            } else {
+                errors[ch] = err;
+            }
+        }
+    }
+
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        if (errors[ch] != ESP_OK) {
+            // Once per period, not per read
+            ESP_LOGE(TAG, "Failed to read %s sensor: %s", sensor_drivers[ch].name, esp_err_to_name(errors[ch]));
+        }
+        const burst_stats_t* st = &stats[ch];
+        float* out = values + ch * SENSOR_STAT_COUNT;
+        bool valid = st->count > 0;
+#if SENSOR_STAT_MEAN
+        *out++ = valid ? st->mean : NAN;
+#endif
+#if SENSOR_STAT_MIN
+        *out++ = valid ? st->min : NAN;
+#endif
+#if SENSOR_STAT_MAX
+        *out++ = valid ? st->max : NAN;
+#endif
+#if SENSOR_STAT_STDDEV
+        *out++ = valid ? sqrtf(st->m2 / st->count) : NAN;
+#endif
+        (void)out;
+        (void)valid;
+    }
+}
+
+int sensors_column_name(int col, char* buf, size_t size)
+{
+    const sensor_driver_t* drv = sensors_column_driver(col);
+    if (SENSOR_STAT_COUNT == 1 && SENSOR_STAT_MEAN) {
+        return snprintf(buf, size, "%s_%s", drv->name, drv->unit);
+    }
+    return snprintf(buf, size, "%s_%s_%s", drv->name, drv->unit, s_stat_names[col % SENSOR_STAT_COUNT]);
+}
+
+uint32_t sensors_layout_id(void)
+{
+    uint32_t crc = SENSOR_CHANNEL_COUNT;
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        crc = esp_rom_crc32_le(crc, (const uint8_t*)sensor_drivers[ch].name, strlen(sensor_drivers[ch].name));
+        crc = esp_rom_crc32_le(crc, (const uint8_t*)sensor_drivers[ch].unit, strlen(sensor_drivers[ch].unit));
+        crc = esp_rom_crc32_le(crc, &sensor_drivers[ch].decimals, 1);
+    }
+    // Mean-only tables keep the id they had before burst statistics existed
+    if (SENSOR_STAT_COUNT != 1 || !SENSOR_STAT_MEAN) {
+        for (int i = 0; i < SENSOR_STAT_COUNT; i++) {
+            crc = esp_rom_crc32_le(crc, (const uint8_t*)s_stat_names[i], strlen(s_stat_names[i]));
+        }
+    }
+    return crc;
+}
+
+stats_op_t* sensors_read_stats(int ch)
+{
+    return &s_read_stats[ch];
+}
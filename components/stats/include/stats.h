@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_timer.h"
+
+// Latency statistics for instrumented operations. Each module owns the stats_op_t of the operations it
+// times and exposes them for the `stats` command. Recording costs one esp_timer_get_time() call per
+// stamp and a short critical section, cheap enough to stay enabled in production builds
+
+#define STATS_ENABLE 1          // 0 compiles every stamp and record down to nothing
+#define STATS_HIST_BUCKETS 24   // log2 buckets of microseconds, the last one also counts everything above 4 s
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t hist[STATS_HIST_BUCKETS];  // Bucket b counts durations below 2^b us that are not in bucket b-1
+} stats_op_t;
+
+// Start stamp for stats_end
+static inline int64_t stats_begin(void)
+{
+#if STATS_ENABLE
+    return esp_timer_get_time();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Add one duration to an operation (thread-safe, not from ISRs)
+ * @param op Operation to update
+ * @param us Duration in microseconds
+ */
+void stats_record(stats_op_t* op, uint32_t us);
+
+// Record the time since start_us, a stamp from stats_begin
+static inline void stats_end(stats_op_t* op, int64_t start_us)
+{
+#if STATS_ENABLE
+    int64_t us = esp_timer_get_time() - start_us;
+    stats_record(op, us < 0 ? 0 : us > UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+#endif
+}
+
+// Raise a high-water mark to level, unlocked, two tasks raising it at once may keep the lower level
+static inline void stats_high_water(uint32_t* mark, uint32_t level)
+{
+#if STATS_ENABLE
+    if (level > *mark) *mark = level;
+#endif
+}
+
+// Clear an operation (thread-safe)
+void stats_reset(stats_op_t* op);
+
+/**
+ * @brief Format one operation as a CSV line "name,count,min_us,mean_us,max_us,histogram"
+ *
+ * The histogram lists the non-empty buckets as "upper_us:count" separated by spaces, where upper_us
+ * is the exclusive upper bound of the bucket.
+ *
+ * @return Length written, without null terminator, truncated to size - 1
+ */
+int stats_format(char* buf, size_t size, const char* name, const stats_op_t* op);
@@ -0,0 +1,53 @@
+#include <string.h>
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "stats.h"
+
+// One lock for all operations, held for a few instructions per record
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint32_t stats_bucket(uint32_t us)
+{
+    uint32_t bucket = us ? 32 - __builtin_clz(us) : 0;
+    return bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1;
+}
+
+void stats_record(stats_op_t* op, uint32_t us)
+{
+    uint32_t bucket = stats_bucket(us);
+    portENTER_CRITICAL(&s_lock);
+    if (op->count == 0 || us < op->min_us) op->min_us = us;
+    if (us > op->max_us) op->max_us = us;
+    op->count++;
+    op->sum_us += us;
+    op->hist[bucket]++;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void stats_reset(stats_op_t* op)
+{
+    portENTER_CRITICAL(&s_lock);
+    memset(op, 0, sizeof(*op));
+    portEXIT_CRITICAL(&s_lock);
+}
+
+int stats_format(char* buf, size_t size, const char* name, const stats_op_t* op)
+{
+    // Snapshot first, formatting is too slow to run inside the critical section
+    stats_op_t snap;
+    portENTER_CRITICAL(&s_lock);
+    memcpy(&snap, op, sizeof(snap));
+    portEXIT_CRITICAL(&s_lock);
+
+    int len = snprintf(buf, size, "%s,%lu,%lu,%lu,%lu,", name, snap.count, snap.min_us,
+                       snap.count ? (uint32_t)(snap.sum_us / snap.count) : 0, snap.max_us);
+    const char* sep = "";
+    for (int b = 0; b < STATS_HIST_BUCKETS && len < (int)size; b++) {
+        if (snap.hist[b] == 0) continue;
+        len += snprintf(buf + len, size - len, "%s%lu:%lu", sep, 1UL << b, snap.hist[b]);
+        sep = " ";
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
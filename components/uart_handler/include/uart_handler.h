@@ -4,41 +4,128 @@
 #include <stdbool.h>
 #include "esp_err.h"
 #include "freertos/queue.h"
+#include "stats.h"
 
 // Helper component in order to safely input and output char strings to serial, accepts both CR (\r) and LF (\n) as command terminators
 
 #define EVT_QUEUE_SIZE 8
 #define CMD_QUEUE_SIZE 8
+#define TX_QUEUE_SIZE 16
+
+#define UART_HANDLER_POOL_COUNT 8       // Pooled TX buffers for uart_handler_send / uart_handler_printf
+#define UART_HANDLER_POOL_BUF_SIZE 256
+#define UART_HANDLER_MAX_IOV 4          // Max segments per uart_handler_send_iov call
 
 
 #define MAX_CMD_LEN 64 // including null terminator, feel free to adjust as needed
 
+#define UART_HANDLER_DEFAULT_BAUD 115200
+#define UART_HANDLER_MIN_BAUD 9600
+#define UART_HANDLER_MAX_BAUD 5000000  // UART limit on ESP32-S2, actual ceiling depends on USB-serial adapter
+#define UART_HANDLER_RTS_PIN 33        // Any free GPIO, routed through GPIO matrix when flow control is enabled
+#define UART_HANDLER_CTS_PIN 34
+
 typedef struct {
     char    str[MAX_CMD_LEN];
     uint16_t size;
 } command_t;
 
+// Instrumentation for the stats command
+typedef struct {
+    stats_op_t tx;            // Time the TX task spends writing one request into the UART
+    uint32_t rx_overflows;    // UART_FIFO_OVF and UART_BUFFER_FULL events, received input was dropped
+    uint32_t tx_queue_high;   // Most TX requests queued at once, of TX_QUEUE_SIZE
+} uart_handler_stats_t;
+
+// Segment of a caller-owned TX buffer
+typedef struct {
+    const void* data;
+    size_t len;
+} uart_handler_iov_t;
+
+// Called from TX task once all segments of a request have been written
+typedef void (*uart_handler_tx_done_t)(void* arg);
+
 /**
  * @brief Initialize UART component with character-by-character input handling
  *
- * Initializes UART0 at 115200 baud with the following behavior:
+ * Initializes UART0 at given baud rate with the following behavior:
  * - Characters are echoed immediately for user feedback
  * - Commands are limited to MAX_CMD_LEN characters counting null terminator
  * - Characters beyond 15 are echoed but discarded until line ending
  * - Accepts both CR (\r) and LF (\n) as command terminators
  * - Commands are sent to queue when CR or LF is received
  *
+ * @param baud_rate Baud rate, UART_HANDLER_DEFAULT_BAUD unless host confirmed a different one
+ * @param flow_ctrl Enable RTS/CTS hardware flow control on UART_HANDLER_RTS_PIN / UART_HANDLER_CTS_PIN
  * @return ESP_OK on success, ESP_FAIL on failure
  */
-esp_err_t uart_handler_init();
+esp_err_t uart_handler_init(uint32_t baud_rate, bool flow_ctrl);
+
+/**
+ * @brief Change baud rate and flow control at runtime (thread-safe)
+ *
+ * Waits for pending output to be sent at the old settings before switching.
+ *
+ * @param baud_rate New baud rate
+ * @param flow_ctrl Enable RTS/CTS hardware flow control
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if baud rate is out of range
+ */
+esp_err_t uart_handler_configure(uint32_t baud_rate, bool flow_ctrl);
 
 // blocks until command string is ready
 QueueHandle_t uart_handler_get_queue(void);
 
 /**
  * @brief Send raw bytes (thread-safe)
+ *
+ * Data is copied into pooled buffers and written by the TX task, the call only
+ * blocks while all pooled buffers are in flight.
+ *
  * @param data Pointer to the char string
  * @param len Length of char string
  * @return ESP_OK on success, ESP_FAIL on failure
  */
 esp_err_t uart_handler_send(const char* data, size_t len);
+
+/**
+ * @brief Queue caller-owned buffers without copying (thread-safe)
+ *
+ * Segments are written back to back, not interleaved with other output. Buffers must
+ * stay valid until done is called.
+ *
+ * @param iov Segments to send, the array itself may be reused immediately
+ * @param count Number of segments, at most UART_HANDLER_MAX_IOV
+ * @param done Completion callback run in TX task, may be NULL
+ * @param arg Argument for done
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if count is too large
+ */
+esp_err_t uart_handler_send_iov(const uart_handler_iov_t* iov, size_t count,
+                                uart_handler_tx_done_t done, void* arg);
+
+/**
+ * @brief Format straight into a pooled TX buffer and queue it (thread-safe)
+ *
+ * Output longer than UART_HANDLER_POOL_BUF_SIZE - 1 characters is truncated.
+ *
+ * @return ESP_OK on success, ESP_FAIL on formatting error
+ */
+esp_err_t uart_handler_printf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief Wait until everything queued so far has been handed to the UART
+ * @param wait Max ticks to wait
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if output is still pending
+ */
+esp_err_t uart_handler_flush(TickType_t wait);
+
+/**
+ * @brief Wait until everything queued so far has left the UART, unlike uart_handler_flush
+ * also the driver buffer and the hardware FIFO
+ * @param wait Max ticks to wait
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if output is still pending
+ */
+esp_err_t uart_handler_drain(TickType_t wait);
+
+// Live counters, read and cleared in place by the stats command
+uart_handler_stats_t* uart_handler_get_stats(void);
@@ -1,26 +1,115 @@
 #include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
 
 #include "esp_log.h"
 #include "driver/uart.h"
+#include "esp_sleep.h"
 
 #include "freertos/semphr.h"
 
 #include "uart_handler.h"
 
 static const char *TAG = "uart_handler";
-static SemaphoreHandle_t   s_tx_mutex;
+
+#define TX_DRAIN_TIMEOUT_MS 1000
+#define RX_FLOW_CTRL_THRESH 100  // RX FIFO level at which RTS is deasserted (FIFO is 128 bytes)
+#define TX_TASK_PRIORITY 11      // Below input task so echo and command parsing stay responsive
+#define WAKEUP_THRESHOLD 3       // RX edges that wake the chip from light sleep, these characters are lost
+
+// Queued TX request, segments are written back to back by the TX task
+typedef struct {
+    uart_handler_iov_t iov[UART_HANDLER_MAX_IOV];
+    size_t count;
+    char* pool_buf;               // Returned to pool once written, NULL for caller-owned buffers
+    uart_handler_tx_done_t done;
+    void* arg;
+} tx_request_t;
+
+static SemaphoreHandle_t   s_tx_mutex;      // Held by TX task while writing, and while reconfiguring
 static QueueHandle_t       s_evt_queue;
 static QueueHandle_t       s_cmd_queue;
+static QueueHandle_t       s_tx_queue;
+static QueueHandle_t       s_tx_pool;       // Free pooled buffers
+static SemaphoreHandle_t   s_tx_flushed;
+static SemaphoreHandle_t   s_flush_mutex;
+static volatile uint32_t   s_flush_gen = 0;
+static char s_tx_pool_mem[UART_HANDLER_POOL_COUNT][UART_HANDLER_POOL_BUF_SIZE];
+
+static uart_handler_stats_t s_stats;
 
 static char   s_cmd_buf[MAX_CMD_LEN];
 static size_t s_cmd_idx = 0;
 static bool   s_cmd_overflow = false;
 
-static void uart_handler_echo_char(char c)
+static void uart_handler_tx_write(const tx_request_t* req)
+{
+    xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+    int64_t start_us = stats_begin();
+    for (size_t i = 0; i < req->count; i++) {
+        // No driver TX ring, so this writes straight from the request buffer into the FIFO
+        uart_write_bytes(UART_NUM_0, req->iov[i].data, req->iov[i].len);
+    }
+    stats_end(&s_stats.tx, start_us);
+    xSemaphoreGive(s_tx_mutex);
+
+    if (req->pool_buf) {
+        xQueueSend(s_tx_pool, &req->pool_buf, portMAX_DELAY);
+    }
+    if (req->done) {
+        req->done(req->arg);
+    }
+}
+
+static void uart_handler_tx_task(void *parameters)
+{
+    tx_request_t req;
+    for (;;) {
+        xQueueReceive(s_tx_queue, &req, portMAX_DELAY);
+        uart_handler_tx_write(&req);
+    }
+}
+
+// Blocks only while all pooled buffers are queued, which throttles callers to the line rate
+static char* uart_handler_pool_get(void)
+{
+    char* buf = NULL;
+    xQueueReceive(s_tx_pool, &buf, portMAX_DELAY);
+    return buf;
+}
+
+static esp_err_t uart_handler_queue_tx(const tx_request_t* req)
+{
+    if (xQueueSend(s_tx_queue, req, portMAX_DELAY) != pdTRUE)
+        return ESP_FAIL;
+    stats_high_water(&s_stats.tx_queue_high, uxQueueMessagesWaiting(s_tx_queue));
+    return ESP_OK;
+}
+
+static esp_err_t uart_handler_pool_send(char* buf, size_t len)
+{
+    tx_request_t req = {
+        .iov = { { .data = buf, .len = len } },
+        .count = 1,
+        .pool_buf = buf
+    };
+    return uart_handler_queue_tx(&req);
+}
+
+// Echo is collected per received chunk and sent as one write
+static void uart_handler_echo_char(char* echo, size_t* echo_len, char c)
 {
     // Echo printable characters and newline
     if ((c >= 32 && c <= 126) || c == '\n' || c == '\r') {
-        uart_write_bytes(UART_NUM_0, &c, 1);
+        echo[(*echo_len)++] = c;
+    }
+}
+
+static void uart_handler_echo_flush(const char* echo, size_t* echo_len)
+{
+    if (*echo_len > 0) {
+        uart_handler_send(echo, *echo_len);
+        *echo_len = 0;
     }
 }
 
@@ -28,10 +117,13 @@ static void uart_handler_input_evt_task(void *parameters)
 {
     uart_event_t ev;
     uint8_t buf[128];
+    char echo[2 * sizeof(buf)];  // Every char may expand to CRLF
+    size_t echo_len = 0;
     for (;;) {
         xQueueReceive(s_evt_queue, &ev, portMAX_DELAY);
         if (ev.type == UART_FIFO_OVF || ev.type == UART_BUFFER_FULL) {
             ESP_LOGW(TAG, "Overflow—flushing");
+            s_stats.rx_overflows++;
             uart_flush_input(UART_NUM_0);
             s_cmd_idx = 0;
             s_cmd_overflow = false;
@@ -47,8 +139,10 @@ static void uart_handler_input_evt_task(void *parameters)
             // Handle both \r and \n as command terminators (supports CR, LF, CRLF, LFCR)
             if (c == '\r' || c == '\n') {
                 // Echo CRLF for proper terminal behavior (return to column 0 + new line)
-                uart_handler_echo_char('\r');
-                uart_handler_echo_char('\n');
+                uart_handler_echo_char(echo, &echo_len, '\r');
+                uart_handler_echo_char(echo, &echo_len, '\n');
+                // Echo must go out before any reply to the command
+                uart_handler_echo_flush(echo, &echo_len);
 
                 // Only send command if we have content and no overflow occurred
                 if (s_cmd_idx > 0 && !s_cmd_overflow) {
@@ -67,46 +161,100 @@ static void uart_handler_input_evt_task(void *parameters)
 
             // If in overflow state, echo but discard the char
             if (s_cmd_overflow) {
-                uart_handler_echo_char(c);
+                uart_handler_echo_char(echo, &echo_len, c);
                 continue;
             }
 
             // If buffer has room, accept the character
             if (s_cmd_idx < MAX_CMD_LEN - 1) {
                 s_cmd_buf[s_cmd_idx++] = c;
-                uart_handler_echo_char(c);
+                uart_handler_echo_char(echo, &echo_len, c);
                 continue;
             }
             // Buffer is full (15 chars), enter overflow state
             s_cmd_overflow = true;
         }
+        uart_handler_echo_flush(echo, &echo_len);
     }
 }
 
-esp_err_t uart_handler_init()
+static void uart_handler_apply_flow_ctrl(bool flow_ctrl)
+{
+    if (flow_ctrl) {
+        uart_set_pin(UART_NUM_0, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE,
+                     UART_HANDLER_RTS_PIN, UART_HANDLER_CTS_PIN);
+        uart_set_hw_flow_ctrl(UART_NUM_0, UART_HW_FLOWCTRL_CTS_RTS, RX_FLOW_CTRL_THRESH);
+    } else {
+        uart_set_hw_flow_ctrl(UART_NUM_0, UART_HW_FLOWCTRL_DISABLE, 0);
+    }
+}
+
+esp_err_t uart_handler_init(uint32_t baud_rate, bool flow_ctrl)
 {
     s_tx_mutex     = xSemaphoreCreateMutex();
     s_evt_queue    = xQueueCreate(EVT_QUEUE_SIZE, sizeof(uart_event_t));
     s_cmd_queue    = xQueueCreate(CMD_QUEUE_SIZE, sizeof(command_t));
+    s_tx_queue     = xQueueCreate(TX_QUEUE_SIZE, sizeof(tx_request_t));
+    s_tx_pool      = xQueueCreate(UART_HANDLER_POOL_COUNT, sizeof(char*));
+    s_tx_flushed   = xSemaphoreCreateBinary();
+    s_flush_mutex  = xSemaphoreCreateMutex();
 
-    if (!s_tx_mutex || !s_evt_queue || !s_cmd_queue)
+    if (!s_tx_mutex || !s_evt_queue || !s_cmd_queue || !s_tx_queue || !s_tx_pool ||
+        !s_tx_flushed || !s_flush_mutex)
         return ESP_FAIL;
 
+    for (int i = 0; i < UART_HANDLER_POOL_COUNT; i++) {
+        char* buf = s_tx_pool_mem[i];
+        xQueueSend(s_tx_pool, &buf, 0);
+    }
+
     uart_config_t cfg = {
-        .baud_rate = 115200,
+        .baud_rate = baud_rate,
         .data_bits = UART_DATA_8_BITS,
         .parity    = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
     };
     uart_param_config(UART_NUM_0, &cfg);
-    uart_driver_install(UART_NUM_0, 1024, 512, EVT_QUEUE_SIZE,
+    // No TX ring: the TX task writes queued buffers straight into the FIFO instead of copying them again
+    uart_driver_install(UART_NUM_0, 1024, 0, EVT_QUEUE_SIZE,
                         &s_evt_queue, 0);
+    uart_handler_apply_flow_ctrl(flow_ctrl);
+
+    // Only matters when automatic light sleep is enabled
+    uart_set_wakeup_threshold(UART_NUM_0, WAKEUP_THRESHOLD);
+    esp_sleep_enable_uart_wakeup(UART_NUM_0);
+
     xTaskCreate(uart_handler_input_evt_task, "uart_evt", 4096,
                 NULL, 12, NULL);
+    xTaskCreate(uart_handler_tx_task, "uart_tx", 3072,
+                NULL, TX_TASK_PRIORITY, NULL);
     return ESP_OK;
 }
 
+esp_err_t uart_handler_configure(uint32_t baud_rate, bool flow_ctrl)
+{
+    if (baud_rate < UART_HANDLER_MIN_BAUD || baud_rate > UART_HANDLER_MAX_BAUD)
+        return ESP_ERR_INVALID_ARG;
+
+    // Let queued output go out at the old settings first. If the host holds CTS, the TX task
+    // stays stuck mid-write, so switch anyway once the timeout expires to get unstuck
+    uart_handler_flush(pdMS_TO_TICKS(TX_DRAIN_TIMEOUT_MS));
+    bool locked = xSemaphoreTake(s_tx_mutex, pdMS_TO_TICKS(TX_DRAIN_TIMEOUT_MS)) == pdTRUE;
+    if (locked) {
+        uart_wait_tx_done(UART_NUM_0, pdMS_TO_TICKS(TX_DRAIN_TIMEOUT_MS));
+    }
+    esp_err_t err = uart_set_baudrate(UART_NUM_0, baud_rate);
+    if (err == ESP_OK) {
+        uart_handler_apply_flow_ctrl(flow_ctrl);
+        ESP_LOGI(TAG, "Baud %lu, flow control %s", baud_rate, flow_ctrl ? "on" : "off");
+    }
+    if (locked) {
+        xSemaphoreGive(s_tx_mutex);
+    }
+    return err;
+}
+
 QueueHandle_t uart_handler_get_queue(void)
 {
     return s_cmd_queue;
@@ -114,10 +262,85 @@ QueueHandle_t uart_handler_get_queue(void)
 
 esp_err_t uart_handler_send(const char* data, size_t len)
 {
-    if (xSemaphoreTake(s_tx_mutex, portMAX_DELAY) == pdTRUE) {
-        uint32_t w = uart_write_bytes(UART_NUM_0, data, len);
-        xSemaphoreGive(s_tx_mutex);
-        return (w == len) ? ESP_OK : ESP_FAIL;
+    // Copy in pool sized chunks so the caller's buffer can be reused right away
+    while (len > 0) {
+        size_t chunk = (len < UART_HANDLER_POOL_BUF_SIZE) ? len : UART_HANDLER_POOL_BUF_SIZE;
+        char* buf = uart_handler_pool_get();
+        memcpy(buf, data, chunk);
+        esp_err_t err = uart_handler_pool_send(buf, chunk);
+        if (err != ESP_OK)
+            return err;
+        data += chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
+}
+
+esp_err_t uart_handler_send_iov(const uart_handler_iov_t* iov, size_t count,
+                                uart_handler_tx_done_t done, void* arg)
+{
+    if (count > UART_HANDLER_MAX_IOV)
+        return ESP_ERR_INVALID_ARG;
+
+    tx_request_t req = { .count = count, .done = done, .arg = arg };
+    if (count > 0)
+        memcpy(req.iov, iov, count * sizeof(*iov));
+    return uart_handler_queue_tx(&req);
+}
+
+esp_err_t uart_handler_printf(const char* fmt, ...)
+{
+    char* buf = uart_handler_pool_get();
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, UART_HANDLER_POOL_BUF_SIZE, fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        xQueueSend(s_tx_pool, &buf, portMAX_DELAY);
+        return ESP_FAIL;
+    }
+    if (len >= UART_HANDLER_POOL_BUF_SIZE)
+        len = UART_HANDLER_POOL_BUF_SIZE - 1;  // Truncated
+    return uart_handler_pool_send(buf, len);
+}
+
+static void uart_handler_flush_done(void* arg)
+{
+    // Ignore markers of earlier flushes that timed out
+    if ((uint32_t)(uintptr_t)arg == s_flush_gen) {
+        xSemaphoreGive(s_tx_flushed);
     }
-    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t uart_handler_flush(TickType_t wait)
+{
+    xSemaphoreTake(s_flush_mutex, portMAX_DELAY);
+    uint32_t gen = ++s_flush_gen;
+    xSemaphoreTake(s_tx_flushed, 0);
+
+    // Empty request completes once everything queued before it has been written
+    esp_err_t err = uart_handler_send_iov(NULL, 0, uart_handler_flush_done, (void*)(uintptr_t)gen);
+    if (err == ESP_OK && xSemaphoreTake(s_tx_flushed, wait) != pdTRUE) {
+        err = ESP_ERR_TIMEOUT;
+    }
+    xSemaphoreGive(s_flush_mutex);
+    return err;
+}
+
+esp_err_t uart_handler_drain(TickType_t wait)
+{
+    TickType_t start = xTaskGetTickCount();
+    esp_err_t err = uart_handler_flush(wait);
+    if (err != ESP_OK) {
+        return err;
+    }
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    return uart_wait_tx_done(UART_NUM_0, elapsed < wait ? wait - elapsed : 0);
+}
+
+uart_handler_stats_t* uart_handler_get_stats(void)
+{
+    return &s_stats;
 }
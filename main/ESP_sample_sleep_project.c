@@ -1,355 +1,2284 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "esp_partition.h"
 #include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_rom_crc.h"
+#include "esp_sleep.h"
+#include "esp_pm.h"
+#include "driver/gpio.h"
+#include "driver/spi_common.h"
+#include "esp_flash.h"
+#include "esp_flash_spi_init.h"
 
 #include "esp_err.h"
 #include "esp_log.h"
 
 #include "uart_handler.h"
-#include "driver/temperature_sensor.h"
+#include "sensors.h"
+#include "cmd_table.h"
+#include "stats.h"
+#include "log_storage.h"
 
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <math.h>
 
 static const char *TAG = "main";
 
-#define SETTINGS_MAGIC 0xDEADBEEF  // Change magic number to force re-initialization
-#define LOG_START 4096
+#define SETTINGS_MAGIC 0xDEADBEF8  // Change magic number to force re-initialization
 
 #define MIN_LOGGING_PERIOD_MS 5
 #define DEFAULT_LOGGING_PERIOD_MS 5000
-#define DATA_SPLICE_GAP_MS 60000        // Gap added to timestamp on boot to mark data splice from power surge (60s)
+#define UART_CONFIRM_TIMEOUT_MS 10000   // Host must confirm new UART settings within this time or they are reverted
+
+#define DEFAULT_FAST_PERIOD_MS 100      // Sample period while the adaptive trigger holds, see Adaptive Sampling
+#define DEEP_SLEEP_MIN_PERIOD_MS 1000   // Below this a wakeup costs more than staying in light sleep
+#define DEEP_SLEEP_CONSOLE_MS 30000     // Console stays awake this long after boot or last command before deep sleep
+#define DEEP_SLEEP_WAKE_GPIO GPIO_NUM_0 // BOOT button, wakes to full console instead of taking a sample
+#define SLEEP_STATE_MAGIC 0x51EE9A80    // Marks RTC deep sleep state as valid
+
+#define SAMPLER_TASK_PRIORITY 20        // Above UART and storage tasks so sampling deadlines are met first
+#define STORAGE_TASK_PRIORITY 8
+#define ERASE_TASK_PRIORITY 6           // Background pre-erase, runs whenever storage is idle
+#define STREAM_TASK_PRIORITY 4          // Live stream output, below storage so it never delays flash writes
+#define ENTRY_QUEUE_LEN 64              // Entries buffered between sampler and storage task (covers several sector erases at 5ms)
+#define STORAGE_BATCH_MAX_MS 50         // Longest an entry waits in the queue before the sampler wakes the storage task
+#define STORAGE_BATCH_MAX_ENTRIES 16    // Entries queued per storage task wakeup at most, leaves room for erases
+#define STREAM_QUEUE_LEN 32             // Entries buffered for the live stream, more are dropped while the UART is behind
+
+#define BENCH_RATE_START_MS 10          // First period bench rate tries, lowered until deadlines are missed
+#define BENCH_RATE_MAX_START_MS 100     // Steps log a fixed number of entries, so longer periods take minutes
+#define BENCH_RATE_STEP_SECTORS 2       // Raw sectors of entries logged per step, so every step crosses sector erases
+#define BENCH_RECOVER_RUNS 20           // Repetitions per recovery path in bench recover
+
+#define EXT_FLASH_ENABLE 0              // Continue the log on an external SPI NOR chip, see Storage Backends
+#define EXT_FLASH_HOST SPI2_HOST        // External log flash, pins are the FSPI IO_MUX pins of the ESP32-S2
+#define EXT_FLASH_PIN_CS 10
+#define EXT_FLASH_PIN_MOSI 11
+#define EXT_FLASH_PIN_CLK 12
+#define EXT_FLASH_PIN_MISO 13
+#define EXT_FLASH_FREQ_MHZ 40
+#define EXT_FLASH_LABEL "ext_log"       // Registered as a data partition of subtype 0x40, picked up like one from the table
+
+#define DUMPBIN_MAGIC 0x4E494244        // "DBIN", starts every binary dump frame
+#define LOG_FORMAT_VERSION 3            // Bump when log_entry_t layout changes, tells host decoder how to parse frames
 
 // States for settings.state
 #define IDLE    0U
 #define LOGGING 1U
 #define ERROR   2U
 
+// Modes for settings.sleep_mode
+#define SLEEP_NONE  0U
+#define SLEEP_LIGHT 1U
+#define SLEEP_DEEP  2U
+
+// Live stream modes
+#define STREAM_OFF    0U
+#define STREAM_CSV    1U
+#define STREAM_BINARY 2U
+
+// Adaptive trigger modes
+#define TRIGGER_OFF   0U
+#define TRIGGER_ABOVE 1U
+#define TRIGGER_BELOW 2U
+
 static inline void send_msg(const char* msg) {
     uart_handler_send(msg, strlen(msg));
 }
 
+// Storage logs under its own tag, keep it at the console's level so dumps are not interleaved with it
+static void log_level_set(esp_log_level_t level)
+{
+    esp_log_level_set(TAG, level);
+    esp_log_level_set("log_storage", level);
+}
+
+
+// Sampler -> storage pipeline, sampler never touches flash
+static esp_timer_handle_t s_sample_timer = NULL;
+static TaskHandle_t s_sampler_task = NULL;
+static TaskHandle_t s_storage_task = NULL;
+static QueueHandle_t s_entry_queue = NULL;
+static volatile bool s_sampling = false;
+static uint32_t s_dropped_entries = 0;    // Samples lost to a full entry queue
+static uint32_t s_missed_deadlines = 0;   // Timer ticks that fired before previous sample was taken
+static uint64_t s_last_sample_ms = 0;     // Timestamp of newest sample, deep sleep schedules from it
+static uint32_t s_sample_tick = 0;        // Logging periods since sampling started, drives channel decimation
+static uint32_t s_storage_batch = 1;      // Queued entries that wake the storage task, see storage_batch()
+static uint8_t s_decimation[SENSOR_CHANNEL_COUNT];  // Channel sampled every Nth period
+static uint8_t s_burst = SENSOR_DEFAULT_BURST;      // Reads per channel and period, aggregated into one entry
+
+// Live stream, the sampler tees entries into a bounded queue that stream_task sends
+static QueueHandle_t s_stream_queue = NULL;
+static volatile uint32_t s_stream_mode = STREAM_OFF;
+static uint32_t s_stream_seq = 0;         // Samples teed since the stream was turned on
+static uint32_t s_stream_dropped = 0;     // Samples lost to a full stream queue
+
+// Instrumentation for the stats command
+static stats_op_t s_sample_late_stats;    // Time from when a sample was scheduled until it was taken
+static uint32_t s_entry_queue_high = 0;   // Most entries waiting for the storage task
+static uint32_t s_stream_queue_high = 0;  // Most entries waiting for the stream task
+static uint32_t s_storage_wakes = 0;      // Times the storage task woke up, per batch of entries or flush deadline
+static int64_t s_sample_due_us = 0;       // When the next sample is scheduled
+static uint32_t s_sample_period_us = 0;
+static int64_t s_boot_recover_us = -1;    // Time log_storage_recover took at boot, -1 if the partition was formatted
+static volatile bool s_flush_each_entry = false;  // bench rate: commit every entry on its own instead of a page at a time
+static uint32_t s_period_ms = 0;          // Logging period, the sample period unless the adaptive trigger holds
+static uint32_t s_batch_samples = 0;      // Samples taken since the storage task was last woken
+static volatile bool s_retime_pending = false;  // Period changed while sampling, the sampler retimes at its next wakeup
+
+// Which samples become log entries, all of them with the defaults
+typedef struct {
+    float deadband[SENSOR_CHANNEL_COUNT];  // Log a channel once it moved more than this since its last logged value, 0 logs every sample
+    uint32_t heartbeat_ms;    // Log an entry at least this often however flat the values, 0 for never
+    uint32_t fast_period_ms;  // Sample period while the trigger holds, every sample is logged then
+    float trigger_level;
+    uint8_t trigger_mode;     // TRIGGER_OFF, TRIGGER_ABOVE or TRIGGER_BELOW
+    uint8_t trigger_channel;  // Compared on the first column of the channel
+} __attribute__((packed)) adaptive_config_t;
+
+// Adaptive filter state, kept across deep sleep
+typedef struct {
+    float ref[SENSOR_VALUE_COUNT];  // Values of the last logged entry, NaN until a column was logged
+    uint64_t committed_ms;    // Timestamp of the last logged entry
+    uint32_t skipped;         // Samples the deadband kept out of the log
+    bool fast;                // Trigger holds, sampling at fast_period_ms
+} adaptive_state_t;
+
+static adaptive_config_t s_adaptive;      // Copy of settings for the sampler task, see adaptive_config_set()
+static portMUX_TYPE s_adaptive_lock = portMUX_INITIALIZER_UNLOCKED;
+static adaptive_state_t s_adaptive_state;
+
+// Hand a new config to the sampler, which copies it whole so a trigger never mixes old and new fields
+static void adaptive_config_set(const adaptive_config_t* adaptive)
+{
+    portENTER_CRITICAL(&s_adaptive_lock);
+    s_adaptive = *adaptive;
+    portEXIT_CRITICAL(&s_adaptive_lock);
+}
+
+static adaptive_config_t adaptive_config_get(void)
+{
+    portENTER_CRITICAL(&s_adaptive_lock);
+    adaptive_config_t adaptive = s_adaptive;
+    portEXIT_CRITICAL(&s_adaptive_lock);
+    return adaptive;
+}
+
+// Settings struct, journaled by log storage
+typedef struct {
+    uint32_t magic;
+    uint32_t logging_period_MS;
+    uint32_t baud_rate;       // Only saved once host confirmed it
+    uint8_t state;
+    uint8_t log_level;
+    uint8_t ring_mode;        // Reclaim oldest sector instead of stopping when full
+    uint8_t flow_ctrl;        // RTS/CTS hardware flow control
+    uint8_t sleep_mode;       // SLEEP_NONE, SLEEP_LIGHT or SLEEP_DEEP
+    uint8_t log_format;       // LOG_FORMAT_RAW or LOG_FORMAT_PACKED, applies to newly opened sectors
+    uint8_t burst;            // Reads per channel and period, 0 in records saved before burst sampling means 1
+    uint8_t padding[1];
+    uint32_t sensor_layout;   // sensors_layout_id() the log was recorded with
+    uint32_t log_sectors;     // Log sectors of partitions and external flash the log was laid out over
+    uint8_t decimation[SENSOR_CHANNEL_COUNT];
+    adaptive_config_t adaptive;
+} __attribute__((packed)) settings_t;
+_Static_assert(sizeof(settings_t) <= LOG_SETTINGS_MAX_SIZE, "settings_t does not fit a settings journal record");
+
+// Settings of a freshly formatted partition
+static void settings_defaults(settings_t* settings)
+{
+    settings->magic = SETTINGS_MAGIC;
+    settings->logging_period_MS = DEFAULT_LOGGING_PERIOD_MS;
+    settings->state = IDLE;
+    settings->log_level = ESP_LOG_INFO;
+    settings->ring_mode = 0;
+    settings->baud_rate = UART_HANDLER_DEFAULT_BAUD;
+    settings->flow_ctrl = 0;
+    settings->sleep_mode = SLEEP_NONE;
+    settings->log_format = LOG_FORMAT_RAW;
+    settings->sensor_layout = sensors_layout_id();
+    settings->log_sectors = log_storage_size_bytes() / FLASH_SECTOR_SIZE;
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        settings->decimation[ch] = sensor_drivers[ch].decimation;
+    }
+    settings->burst = SENSOR_DEFAULT_BURST;
+    settings->adaptive = (adaptive_config_t){ .fast_period_ms = DEFAULT_FAST_PERIOD_MS, .trigger_mode = TRIGGER_OFF };
+}
+
+esp_err_t erase_and_initialize_partition(const esp_partition_t* flash, settings_t* settings)
+{
+    settings_defaults(settings);
+    esp_err_t err = log_storage_format(flash, settings);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    memcpy(s_decimation, settings->decimation, sizeof(s_decimation));
+    s_burst = settings->burst;
+    adaptive_config_set(&settings->adaptive);
+
+    // Set log level
+    log_level_set((esp_log_level_t)settings->log_level);
+
+    return ESP_OK;
+}
+
+// Drain queued and staged entries to flash, caller must hold log_storage_lock()
+static void storage_drain_locked(const esp_partition_t* flash)
+{
+    log_entry_t entry;
+    while (xQueueReceive(s_entry_queue, &entry, 0) == pdTRUE) {
+        log_data_entry(flash, &entry);
+    }
+    log_flush(flash);
+}
+
+// Write entries produced by the sampler, keeps flash latency off the sampling path. Sleeps until the
+// sampler hands over a batch or staged entries reach their flush deadline, not once per entry
+static void storage_task(void* arg)
+{
+    const esp_partition_t* flash = (const esp_partition_t*)arg;
+    log_entry_t entry;
+
+    for (;;) {
+        // Bound how long a partially filled page stays in RAM
+        uint32_t wait_ms = log_flush_wait_ms();
+        TickType_t wait = (wait_ms == UINT32_MAX) ? portMAX_DELAY : (wait_ms == 0) ? 0 : pdMS_TO_TICKS(wait_ms) + 1;
+        ulTaskNotifyTake(pdTRUE, wait);
+        s_storage_wakes++;
+
+        // Receive under the lock so a concurrent drain cannot reorder entries
+        log_storage_lock();
+        while (xQueueReceive(s_entry_queue, &entry, 0) == pdTRUE) {
+            log_data_entry(flash, &entry);
+            if (s_flush_each_entry) log_flush(flash);
+        }
+        if (log_flush_wait_ms() == 0) {
+            log_flush(flash);
+        }
+        log_storage_unlock();
+    }
+}
+
+// Entries the sampler queues before waking the storage task, one per wakeup at slow periods
+static uint32_t storage_batch(uint32_t period_ms)
+{
+    uint32_t batch = STORAGE_BATCH_MAX_MS / period_ms;
+    return (batch < 1) ? 1 : (batch > STORAGE_BATCH_MAX_ENTRIES) ? STORAGE_BATCH_MAX_ENTRIES : batch;
+}
+
+// Start the filter over, the next sample of every channel is logged
+static void adaptive_reset(adaptive_state_t* st)
+{
+    for (int col = 0; col < SENSOR_VALUE_COUNT; col++) {
+        st->ref[col] = NAN;
+    }
+    st->committed_ms = 0;
+    st->fast = false;
+}
+
+// Whether the trigger holds, once it does the value must return past the level by the channel's
+// deadband, so a value hovering at the level does not switch the rate every sample
+static bool adaptive_triggered(const adaptive_config_t* cfg, const log_entry_t* entry, bool fast)
+{
+    if (cfg->trigger_mode == TRIGGER_OFF || cfg->trigger_channel >= SENSOR_CHANNEL_COUNT) return false;
+    float value = entry->values[cfg->trigger_channel * SENSOR_STAT_COUNT];
+    if (isnan(value)) return fast;  // Decimated or failed read, keep the current rate
+    float band = fast ? cfg->deadband[cfg->trigger_channel] : 0.0f;
+    return (cfg->trigger_mode == TRIGGER_ABOVE) ? value > cfg->trigger_level - band :
+                                                  value < cfg->trigger_level + band;
+}
+
+// Update the trigger and decide whether a sample is logged. A channel with a deadband only counts once
+// it moved beyond the deadband from its last logged value, a channel without one whenever it was read
+static bool adaptive_commit(const adaptive_config_t* cfg, adaptive_state_t* st, const log_entry_t* entry)
+{
+    st->fast = adaptive_triggered(cfg, entry, st->fast);
+
+    bool filtered = false;
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        if (cfg->deadband[ch] > 0.0f) filtered = true;
+    }
+    bool commit = !filtered || st->fast ||
+                  (cfg->heartbeat_ms && entry->timestamp - st->committed_ms >= cfg->heartbeat_ms);
+    for (int col = 0; col < SENSOR_VALUE_COUNT && !commit; col++) {
+        float value = entry->values[col];
+        float band = cfg->deadband[col / SENSOR_STAT_COUNT];
+        if (isnan(value)) continue;
+        commit = band <= 0.0f || isnan(st->ref[col]) || fabsf(value - st->ref[col]) > band;
+    }
+
+    if (!commit) {
+        st->skipped++;
+        return false;
+    }
+    for (int col = 0; col < SENSOR_VALUE_COUNT; col++) {
+        if (!isnan(entry->values[col])) st->ref[col] = entry->values[col];
+    }
+    st->committed_ms = entry->timestamp;
+    return true;
+}
+
+// Live stream queue item, a control item switches the stream to mode and carries no entry
+typedef struct {
+    uint32_t seq;             // Sample number since the stream was turned on, gaps show dropped samples
+    bool control;
+    uint8_t mode;             // STREAM_* for a control item
+    log_entry_t entry;
+} stream_item_t;
+
+// Runs in esp_timer task on an absolute period, only wakes the sampler
+static void sample_timer_cb(void* arg)
+{
+    xTaskNotifyGive(s_sampler_task);
+}
+
+// Period the sampler runs at, the fast period while the adaptive trigger holds
+static uint32_t sampler_period_ms(const adaptive_config_t* adaptive)
+{
+    return s_adaptive_state.fast ? adaptive->fast_period_ms : s_period_ms;
+}
+
+// Apply new period to a running timer without resetting the timestamp base, sampler task only
+static void sampler_retime(uint32_t period_ms)
+{
+    if (!s_sampling) return;
+    esp_timer_stop(s_sample_timer);
+    s_sample_period_us = period_ms * 1000;
+    s_storage_batch = storage_batch(period_ms);
+    s_sample_due_us = esp_timer_get_time() + s_sample_period_us;
+    esp_timer_start_periodic(s_sample_timer, (uint64_t)period_ms * 1000);
+}
+
+static void sampler_task(void* arg)
+{
+    for (;;) {
+        uint32_t pending = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!s_sampling) continue;
+        adaptive_config_t adaptive = adaptive_config_get();
+
+        // The console changed the period, the wakeup that asked for it is neither a sample nor a missed
+        // deadline. A late request wakeup arrives well before the restarted timer's first tick
+        if (s_retime_pending) {
+            s_retime_pending = false;
+            sampler_retime(sampler_period_ms(&adaptive));
+        }
+        int64_t now_us = esp_timer_get_time();
+        if (now_us < s_sample_due_us - s_sample_period_us / 2) continue;
+
+        if (pending > 1) {
+            s_missed_deadlines += pending - 1;
+        }
+        stats_record(&s_sample_late_stats, now_us > s_sample_due_us ? (uint32_t)(now_us - s_sample_due_us) : 0);
+        s_sample_due_us += (int64_t)pending * s_sample_period_us;
+
+        log_entry_t entry = { .timestamp = log_time_ms() };
+        float values[SENSOR_VALUE_COUNT];
+        sensors_read(s_sample_tick, s_decimation, s_burst, values);
+        memcpy(entry.values, values, sizeof(values));
+        s_sample_tick += pending;  // Missed periods count too, so decimated channels stay on schedule
+        s_last_sample_ms = entry.timestamp;
+
+        // Never block on storage, count the loss instead
+        if (adaptive_commit(&adaptive, &s_adaptive_state, &entry) && xQueueSend(s_entry_queue, &entry, 0) != pdTRUE) {
+            s_dropped_entries++;
+        }
+        if (sampler_period_ms(&adaptive) * 1000 != s_sample_period_us) {
+            sampler_retime(sampler_period_ms(&adaptive));
+            ESP_LOGI(TAG, "Adaptive trigger %s, sampling every %lu ms", s_adaptive_state.fast ? "holds" : "released",
+                     sampler_period_ms(&adaptive));
+        }
+
+        // Count samples rather than entries, so an entry waits at most one batch of periods while the
+        // deadband keeps other samples out of the queue
+        uint32_t queued = uxQueueMessagesWaiting(s_entry_queue);
+        stats_high_water(&s_entry_queue_high, queued);
+        if (++s_batch_samples >= s_storage_batch && queued > 0) {
+            s_batch_samples = 0;
+            xTaskNotifyGive(s_storage_task);
+        }
+
+        // Same for the live stream, a slow UART loses stream samples but never logged ones
+        if (s_stream_mode != STREAM_OFF) {
+            stream_item_t item = { .seq = s_stream_seq++, .entry = entry };
+            if (xQueueSend(s_stream_queue, &item, 0) != pdTRUE) {
+                s_stream_dropped++;
+            }
+            stats_high_water(&s_stream_queue_high, uxQueueMessagesWaiting(s_stream_queue));
+        }
+    }
+}
+
+// Adaptive state carries over from before the start, a trigger that held keeps the fast period
+static esp_err_t sampler_start(uint32_t period_ms)
+{
+    adaptive_config_t adaptive = adaptive_config_get();
+    s_period_ms = period_ms;
+    period_ms = sampler_period_ms(&adaptive);
+    s_sample_tick = 0;
+    s_batch_samples = 0;
+    s_sample_period_us = period_ms * 1000;
+    s_storage_batch = storage_batch(period_ms);
+    s_sample_due_us = esp_timer_get_time();
+    s_retime_pending = false;
+    s_sampling = true;
+
+    esp_err_t err = esp_timer_start_periodic(s_sample_timer, (uint64_t)period_ms * 1000);
+    if (err != ESP_OK) {
+        s_sampling = false;
+        ESP_LOGE(TAG, "Failed to start sample timer: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // Take first sample immediately rather than one period after start
+    xTaskNotifyGive(s_sampler_task);
+    return ESP_OK;
+}
+
+static void sampler_stop(void)
+{
+    s_sampling = false;
+    esp_timer_stop(s_sample_timer);  // ESP_ERR_INVALID_STATE if not running is fine
+    xTaskNotifyGive(s_storage_task);  // Commit a partial batch left in the queue
+}
+
+// New logging period, takes effect at once unless the adaptive trigger holds. The sampler retimes
+// itself, it owns the timer and the adaptive state while sampling
+static void sampler_set_period(uint32_t period_ms)
+{
+    s_period_ms = period_ms;
+    if (!s_sampling) return;
+    s_retime_pending = true;
+    xTaskNotifyGive(s_sampler_task);
+}
+
+// Logging state kept in RTC memory across deep sleep, lets a timer wakeup take a sample without a full boot
+typedef struct {
+    uint32_t magic;
+    settings_t settings;
+    log_storage_state_t storage;
+    uint64_t next_sample_ms;  // Log time the next sample is due at
+    uint32_t sample_tick;     // Period number of the next sample, keeps decimated channels on schedule
+    uint32_t dropped_entries;
+    uint32_t missed_deadlines;
+    adaptive_state_t adaptive;
+} deep_sleep_state_t;
+
+static RTC_NOINIT_ATTR deep_sleep_state_t s_sleep_state;
+
+static const char* const sleep_mode_names[] = { "none", "light", "deep" };
+static const char* const log_format_names[] = { "raw", "packed" };
+static const char* const stream_mode_names[] = { "off", "csv", "binary" };
+static const char* const trigger_mode_names[] = { "off", "above", "below" };
+
+static bool sleep_state_valid(void)
+{
+    return esp_reset_reason() == ESP_RST_DEEPSLEEP && s_sleep_state.magic == SLEEP_STATE_MAGIC;
+}
+
+// Automatic light sleep between samples, esp_timer and UART input wake the chip
+static esp_err_t sleep_apply_mode(uint8_t mode)
+{
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,  // No frequency scaling, UART baud rate depends on APB clock
+        .light_sleep_enable = (mode != SLEEP_NONE)
+    };
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure power management: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+static bool deep_sleep_allowed(const settings_t* settings)
+{
+    return settings->sleep_mode == SLEEP_DEEP && settings->state == LOGGING &&
+           settings->logging_period_MS >= DEEP_SLEEP_MIN_PERIOD_MS && s_stream_mode == STREAM_OFF &&
+           (settings->adaptive.trigger_mode == TRIGGER_OFF || settings->adaptive.fast_period_ms >= DEEP_SLEEP_MIN_PERIOD_MS);
+}
+
+// Sample period in deep sleep, the fast period while the adaptive trigger holds
+static uint32_t deep_sleep_period_ms(void)
+{
+    return s_sleep_state.adaptive.fast ? s_sleep_state.settings.adaptive.fast_period_ms :
+                                         s_sleep_state.settings.logging_period_MS;
+}
+
+// Sleep until next due sample, staged entries stay in RTC memory instead of being flushed. Does not return
+static void deep_sleep_start(void)
+{
+    uint64_t now_ms = log_time_ms();
+    int64_t sleep_ms = (int64_t)(s_sleep_state.next_sample_ms - now_ms);
+    if (sleep_ms <= 0) {
+        // Overslept, skip to next slot on the schedule
+        uint32_t missed = (uint32_t)(-sleep_ms) / deep_sleep_period_ms() + 1;
+        s_sleep_state.missed_deadlines += missed;
+        s_sleep_state.sample_tick += missed;
+        s_sleep_state.next_sample_ms += missed * deep_sleep_period_ms();
+        sleep_ms = (int64_t)(s_sleep_state.next_sample_ms - now_ms);
+    }
+
+    s_sleep_state.magic = SLEEP_STATE_MAGIC;
+    esp_sleep_enable_timer_wakeup((uint64_t)sleep_ms * 1000);
+    esp_sleep_enable_ext0_wakeup(DEEP_SLEEP_WAKE_GPIO, 0);
+    esp_deep_sleep_start();
+}
+
+// Called from main loop once console was idle for DEEP_SLEEP_CONSOLE_MS
+static void deep_sleep_enter(const esp_partition_t* flash, const settings_t* settings)
+{
+    send_msg("Entering deep sleep, press BOOT to wake console\r\n");
+    ESP_LOGI(TAG, "Entering deep sleep");
+    sampler_stop();
+
+    // Move queued samples into the RTC staging page, no partial page write before sleeping
+    log_storage_lock();
+    log_entry_t entry;
+    while (xQueueReceive(s_entry_queue, &entry, 0) == pdTRUE) {
+        log_data_entry(flash, &entry);
+    }
+
+    s_sleep_state = (deep_sleep_state_t){
+        .settings = *settings,
+        .next_sample_ms = s_last_sample_ms + sampler_period_ms(&settings->adaptive),
+        .sample_tick = s_sample_tick,
+        .dropped_entries = s_dropped_entries,
+        .missed_deadlines = s_missed_deadlines,
+        .adaptive = s_adaptive_state
+    };
+    log_storage_suspend(&s_sleep_state.storage);
+
+    uart_handler_flush(pdMS_TO_TICKS(100));
+    deep_sleep_start();
+}
+
+// Timer wakeup from deep sleep: restore state from RTC memory, take one sample, sleep again. Does not return
+static void deep_sleep_sample(const esp_partition_t* flash)
+{
+    log_level_set((esp_log_level_t)s_sleep_state.settings.log_level);
+    log_storage_resume(&s_sleep_state.storage, &s_sleep_state.settings, s_sleep_state.settings.ring_mode,
+                       s_sleep_state.settings.log_format);
+
+    log_entry_t entry = { .timestamp = log_time_ms() };
+    float values[SENSOR_VALUE_COUNT];
+    sensors_init();
+    sensors_read(s_sleep_state.sample_tick, s_sleep_state.settings.decimation, s_sleep_state.settings.burst, values);
+    memcpy(entry.values, values, sizeof(values));
+
+    // Flash is only written when the staging page fills up
+    if (adaptive_commit(&s_sleep_state.settings.adaptive, &s_sleep_state.adaptive, &entry)) {
+        log_data_entry(flash, &entry);
+    }
+
+    log_storage_suspend(&s_sleep_state.storage);
+    s_sleep_state.next_sample_ms += deep_sleep_period_ms();
+    s_sleep_state.sample_tick++;
+
+    deep_sleep_start();
+}
+
+// CSV column names from the sensor table, e.g. "timestamp_ms,temperature_C". Returns length without line end
+static int csv_header(char* buf, size_t size)
+{
+    int len = snprintf(buf, size, "timestamp_ms");
+    for (int col = 0; col < SENSOR_VALUE_COUNT && len + 1 < (int)size; col++) {
+        buf[len++] = ',';
+        len += sensors_column_name(col, buf + len, size - len);
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+// One CSV row with the driver's precision per channel, missing values are left empty
+static int csv_row(char* buf, size_t size, const log_entry_t* entry)
+{
+    int len = snprintf(buf, size, "%llu", (unsigned long long)entry->timestamp);
+    for (int col = 0; col < SENSOR_VALUE_COUNT && len < (int)size; col++) {
+        if (isnan(entry->values[col])) {
+            len += snprintf(buf + len, size - len, ",");
+        } else {
+            len += snprintf(buf + len, size - len, ",%.*f", sensors_column_driver(col)->decimals, entry->values[col]);
+        }
+    }
+    if (len < (int)size) len += snprintf(buf + len, size - len, "\r\n");
+    return len < (int)size ? len : (int)size - 1;
+}
+
+// Parse "<ms> [to <ms>]" starting at argument i, the words after "from", to defaults to everything newer.
+// The command's spec already checked that both times are numbers
+static bool parse_time_range(const cmd_table_args_t* args, int i, uint64_t* from_ms, uint64_t* to_ms)
+{
+    if (args->argc <= i) return false;
+    *from_ms = args->num[i];
+    *to_ms = UINT64_MAX;
+    if (args->argc > i + 1) {
+        if (args->argc != i + 3 || strcmp(args->argv[i + 1], "to") != 0) return false;
+        *to_ms = args->num[i + 2];
+    }
+    return *to_ms >= *from_ms;
+}
+
+static void csv_send_header(void)
+{
+    char line[UART_HANDLER_POOL_BUF_SIZE];
+    int len = csv_header(line, sizeof(line) - 2);
+    memcpy(line + len, "\r\n", 2);
+    uart_handler_send(line, len + 2);
+}
+
+// Double buffered output for dumps: the console task reads and formats the next buffer while the
+// uart_tx task sends the previous one, so flash reads overlap the serial link instead of alternating with it
+typedef struct {
+    uint8_t* buf[2];
+    size_t size;              // Capacity of each buffer
+    size_t len;               // Bytes in the buffer being filled
+    uint8_t fill;             // Buffer being filled
+    bool held;                // Buffer being filled is no longer in flight
+    bool discard;             // Count buffers instead of sending them, bench dump times formatting alone
+    uint32_t bytes;           // Bytes queued or discarded, cleared by the caller
+    SemaphoreHandle_t free;   // Counts buffers not in flight, given back once the TX task sent one
+} tx_pipe_t;
+
+static void tx_pipe_done(void* arg)
+{
+    xSemaphoreGive(((tx_pipe_t*)arg)->free);
+}
+
+// Buffer to fill, waits while it is still being sent. Buffers are sent in order, so the one
+// freed first is always the one filled next
+static uint8_t* tx_pipe_buf(tx_pipe_t* pipe)
+{
+    if (!pipe->held) {
+        xSemaphoreTake(pipe->free, portMAX_DELAY);
+        pipe->held = true;
+        pipe->len = 0;
+    }
+    return pipe->buf[pipe->fill];
+}
+
+// Queue the len bytes of the buffer being filled and switch to the other one
+static void tx_pipe_send(tx_pipe_t* pipe)
+{
+    if (pipe->held) {
+        uart_handler_iov_t iov = { .data = pipe->buf[pipe->fill], .len = pipe->len };
+        bool sent = !pipe->discard && pipe->len > 0 && uart_handler_send_iov(&iov, 1, tx_pipe_done, pipe) == ESP_OK;
+        if (sent || pipe->discard) {
+            pipe->bytes += pipe->len;
+        }
+        if (sent) {
+            pipe->fill ^= 1;
+        } else {
+            xSemaphoreGive(pipe->free);  // Nothing in flight, keep filling the same buffer
+        }
+    }
+    pipe->held = false;
+    pipe->len = 0;
+}
+
+// Appends rows to a tx_pipe_t given as ctx, the buffer is sent once the next row might not fit
+static void csv_visit(const log_entry_t* entry, void* ctx)
+{
+    tx_pipe_t* pipe = ctx;
+    uint8_t* buf = tx_pipe_buf(pipe);
+    if (pipe->size - pipe->len < UART_HANDLER_POOL_BUF_SIZE) {
+        tx_pipe_send(pipe);
+        buf = tx_pipe_buf(pipe);
+    }
+    pipe->len += csv_row((char*)buf + pipe->len, UART_HANDLER_POOL_BUF_SIZE, entry);
+}
+
+// Rollup tiers for dump rollup, buckets are aligned to multiples of their length in device time
+typedef struct {
+    const char* name;
+    uint32_t bucket_ms;
+} rollup_tier_t;
+
+static const rollup_tier_t rollup_tiers[] = {
+    { "1m", 60 * 1000 },
+    { "1h", 60 * 60 * 1000 },
+    { "1d", 24 * 60 * 60 * 1000 },
+};
+
+#define ROLLUP_TIER_COUNT (sizeof(rollup_tiers) / sizeof(rollup_tiers[0]))
+
+// Record columns a channel's rollup is built from, the matching burst statistic when it is
+// logged, otherwise the channel's first column
+#define ROLLUP_COL_MEAN 0
+#define ROLLUP_COL_MIN (SENSOR_STAT_MIN ? SENSOR_STAT_MEAN : 0)
+#define ROLLUP_COL_MAX (SENSOR_STAT_MAX ? SENSOR_STAT_MEAN + SENSOR_STAT_MIN : 0)
+
+// One bucket being aggregated, sums are double so a day of samples keeps full float resolution
+typedef struct {
+    uint32_t bucket_ms;
+    uint64_t start_ms;
+    uint32_t buckets;          // Buckets sent so far
+    uint32_t count[SENSOR_CHANNEL_COUNT];
+    float min[SENSOR_CHANNEL_COUNT];
+    float max[SENSOR_CHANNEL_COUNT];
+    double sum[SENSOR_CHANNEL_COUNT];
+} rollup_state_t;
+
+static void rollup_send_header(void)
+{
+    char line[UART_HANDLER_POOL_BUF_SIZE];
+    int len = snprintf(line, sizeof(line), "bucket_start_ms");
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT && len < (int)sizeof(line); ch++) {
+        const char* name = sensor_drivers[ch].name;
+        const char* unit = sensor_drivers[ch].unit;
+        len += snprintf(line + len, sizeof(line) - len, ",%s_%s_min,%s_%s_max,%s_%s_mean,%s_count",
+                        name, unit, name, unit, name, unit, name);
+    }
+    if (len < (int)sizeof(line)) len += snprintf(line + len, sizeof(line) - len, "\r\n");
+    uart_handler_send(line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+}
+
+// Send the current bucket as one CSV row and start a new empty one
+static void rollup_flush(rollup_state_t* st)
+{
+    char line[UART_HANDLER_POOL_BUF_SIZE];
+    bool any = false;
+    int len = snprintf(line, sizeof(line), "%llu", (unsigned long long)st->start_ms);
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT && len < (int)sizeof(line); ch++) {
+        uint8_t decimals = sensor_drivers[ch].decimals;
+        if (st->count[ch] == 0) {
+            len += snprintf(line + len, sizeof(line) - len, ",,,,0");
+        } else {
+            len += snprintf(line + len, sizeof(line) - len, ",%.*f,%.*f,%.*f,%lu",
+                            decimals, st->min[ch], decimals, st->max[ch],
+                            decimals, (float)(st->sum[ch] / st->count[ch]), st->count[ch]);
+            any = true;
+        }
+        st->count[ch] = 0;
+        st->sum[ch] = 0;
+    }
+    if (!any) return;
+    if (len < (int)sizeof(line)) len += snprintf(line + len, sizeof(line) - len, "\r\n");
+    uart_handler_send(line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+    st->buckets++;
+}
+
+static void rollup_visit(const log_entry_t* entry, void* ctx)
+{
+    rollup_state_t* st = ctx;
+    uint64_t start_ms = entry->timestamp - entry->timestamp % st->bucket_ms;
+    if (start_ms != st->start_ms) {
+        rollup_flush(st);
+        st->start_ms = start_ms;
+    }
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        const float* col = entry->values + ch * SENSOR_STAT_COUNT;
+        if (isnan(col[ROLLUP_COL_MEAN])) continue;
+        if (st->count[ch] == 0 || col[ROLLUP_COL_MIN] < st->min[ch]) st->min[ch] = col[ROLLUP_COL_MIN];
+        if (st->count[ch] == 0 || col[ROLLUP_COL_MAX] > st->max[ch]) st->max[ch] = col[ROLLUP_COL_MAX];
+        st->sum[ch] += col[ROLLUP_COL_MEAN];
+        st->count[ch]++;
+    }
+}
+
+// Binary dump frame header, followed by length bytes of raw entries and a CRC32 over header and payload
+typedef struct {
+    uint32_t magic;           // DUMPBIN_MAGIC
+    uint8_t version;          // LOG_FORMAT_VERSION
+    uint8_t entry_size;       // sizeof(log_entry_t), 0 for the schema frame
+    uint16_t length;          // Payload bytes, 0 marks end of dump
+    uint32_t first_index;     // Entry number of first entry since last reset, gaps show reclaimed entries
+} __attribute__((packed)) dumpbin_header_t;
+
+// Half a raw sector of entries per frame, one frame is filled while the other is sent. Static
+// since they are too large for the main task stack, CSV dumps use the same buffers
+#define DUMPBIN_FRAME_ENTRIES (ENTRIES_PER_SECTOR / 2)
+#define DUMP_BUF_SIZE (sizeof(dumpbin_header_t) + DUMPBIN_FRAME_ENTRIES * sizeof(log_entry_t) + sizeof(uint32_t))
+static uint8_t s_dump_buf[2][DUMP_BUF_SIZE];
+static tx_pipe_t s_dump_pipe = { .buf = { s_dump_buf[0], s_dump_buf[1] }, .size = DUMP_BUF_SIZE };
+
+// Fill in header and CRC, payload must already be in frame after the header, entry_size 0 marks
+// a schema frame. Returns the frame length
+static uint32_t dumpbin_finish_frame(uint8_t* frame, uint32_t first_index, uint8_t entry_size, uint16_t length)
+{
+    dumpbin_header_t header = {
+        .magic = DUMPBIN_MAGIC,
+        .version = LOG_FORMAT_VERSION,
+        .entry_size = entry_size,
+        .length = length,
+        .first_index = first_index
+    };
+    memcpy(frame, &header, sizeof(header));
+
+    uint32_t len = sizeof(header) + header.length;
+    uint32_t crc = esp_rom_crc32_le(0, frame, len);
+    memcpy(frame + len, &crc, sizeof(crc));
+    return len + sizeof(crc);
+}
+
+static void dumpbin_pipe_frame(tx_pipe_t* pipe, uint32_t first_index, uint8_t entry_size, uint16_t length)
+{
+    pipe->len = dumpbin_finish_frame(tx_pipe_buf(pipe), first_index, entry_size, length);
+    tx_pipe_send(pipe);
+}
+
+// Sent straight from the frame buffer, waits until it is out so the buffer can be refilled
+static void dumpbin_send_frame(uint8_t* frame, uint32_t first_index, uint8_t entry_size, uint16_t length)
+{
+    uart_handler_iov_t iov = { .data = frame, .len = dumpbin_finish_frame(frame, first_index, entry_size, length) };
+    uart_handler_send_iov(&iov, 1, NULL, NULL);
+    uart_handler_flush(portMAX_DELAY);
+}
+
+// Stream count retained entries starting at index from as framed binary. Packed sectors are
+// decoded on the way, frames always carry entries in log_entry_t layout
+static uint32_t dumpbin_send(const esp_partition_t* flash, uint32_t from, uint32_t count)
+{
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t num_entries = log_storage_count();
+    uint32_t tail_first = log_storage_first();
+    log_storage_unlock();
+
+    if (from > num_entries) from = num_entries;
+    if (count > num_entries - from) count = num_entries - from;
+
+    uint32_t pos = tail_first + from;
+    uint32_t end = pos + count;
+    uint32_t sent = 0;
+
+    // Schema frame first, CSV column names so the decoder needs no copy of the channel table
+    char* schema = (char*)(tx_pipe_buf(&s_dump_pipe) + sizeof(dumpbin_header_t));
+    dumpbin_pipe_frame(&s_dump_pipe, pos, 0, csv_header(schema, DUMPBIN_FRAME_ENTRIES * sizeof(log_entry_t)));
+
+    log_reader_t reader = { .index = pos };
+    bool ok = pos < end && log_reader_seek(flash, &reader, pos);
+    while (pos < end) {
+        log_entry_t* entries = (log_entry_t*)(tx_pipe_buf(&s_dump_pipe) + sizeof(dumpbin_header_t));
+        uint32_t first = reader.index;
+        uint32_t n = 0;
+        while (ok && n < DUMPBIN_FRAME_ENTRIES && first + n < end) {
+            log_entry_t entry;
+            ok = log_reader_next(flash, &reader, &entry);
+            if (ok) memcpy(&entries[n++], &entry, sizeof(entry));
+        }
+
+        if (n > 0) {
+            dumpbin_pipe_frame(&s_dump_pipe, first, sizeof(log_entry_t), n * sizeof(log_entry_t));
+            sent += n;
+            pos = first + n;
+        } else if (ok) {
+            break;
+        }
+        if (!ok) {
+            // Same reclaim check as dump, sector may have been handed to the erase task while reading
+            if (log_storage_first() <= pos) break;
+            pos = log_storage_first();
+            ok = log_reader_seek(flash, &reader, pos);
+        }
+    }
+
+    dumpbin_pipe_frame(&s_dump_pipe, pos, sizeof(log_entry_t), 0);
+
+    // Frames are still in flight, logs written directly to UART0 must not cut into them
+    uart_handler_flush(portMAX_DELAY);
+    return sent;
+}
+
+// Live stream frames use the dumpbin layout with sample numbers as index, one per batch of queued entries
+#define STREAM_FRAME_ENTRIES STREAM_QUEUE_LEN
+static uint8_t s_stream_frame[sizeof(dumpbin_header_t) + STREAM_FRAME_ENTRIES * sizeof(log_entry_t) + sizeof(uint32_t)];
+
+// Send teed entries in the current stream mode, waiting on the UART here never holds up the sampler
+static void stream_task(void* arg)
+{
+    uint32_t mode = STREAM_OFF;
+    stream_item_t item;
+
+    for (;;) {
+        xQueueReceive(s_stream_queue, &item, portMAX_DELAY);
+        if (item.control) {
+            if (mode == STREAM_BINARY) {
+                dumpbin_send_frame(s_stream_frame, item.seq, sizeof(log_entry_t), 0);
+            }
+            mode = item.mode;
+            if (mode == STREAM_CSV) {
+                csv_send_header();
+            } else if (mode == STREAM_BINARY) {
+                char* schema = (char*)(s_stream_frame + sizeof(dumpbin_header_t));
+                dumpbin_send_frame(s_stream_frame, item.seq, 0,
+                                   csv_header(schema, STREAM_FRAME_ENTRIES * sizeof(log_entry_t)));
+            }
+            continue;
+        }
+
+        if (mode == STREAM_CSV) {
+            char line[UART_HANDLER_POOL_BUF_SIZE];
+            uart_handler_send(line, csv_row(line, sizeof(line), &item.entry));
+        } else if (mode == STREAM_BINARY) {
+            // Whatever queued up while the last frame was sent goes into this one, up to a gap or mode switch
+            log_entry_t* entries = (log_entry_t*)(s_stream_frame + sizeof(dumpbin_header_t));
+            uint32_t first = item.seq;
+            uint32_t n = 0;
+            entries[n++] = item.entry;
+            while (n < STREAM_FRAME_ENTRIES && xQueuePeek(s_stream_queue, &item, 0) == pdTRUE &&
+                   !item.control && item.seq == first + n) {
+                xQueueReceive(s_stream_queue, &item, 0);
+                entries[n++] = item.entry;
+            }
+            dumpbin_send_frame(s_stream_frame, first, sizeof(log_entry_t), n * sizeof(log_entry_t));
+        }
+    }
+}
+
+// Wait for host to send "ok", anything else (e.g. garbage at a mismatched baud rate) is ignored
+static bool wait_for_uart_confirm(void)
+{
+    QueueHandle_t q = uart_handler_get_queue();
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(UART_CONFIRM_TIMEOUT_MS);
+    command_t reply;
+
+    for (;;) {
+        TickType_t remaining = deadline - xTaskGetTickCount();
+        if ((int32_t)remaining <= 0 || xQueueReceive(q, &reply, remaining) != pdTRUE) {
+            return false;
+        }
+        if (strcmp(reply.str, "ok") == 0) {
+            return true;
+        }
+    }
+}
+
+// Switch UART settings, keep them only if host confirms at the new settings, revert to saved ones otherwise
+static bool uart_switch_confirmed(const settings_t* settings, uint32_t baud_rate, bool flow_ctrl)
+{
+    char msg[96];
+    snprintf(msg, sizeof(msg), "Switching to %lu baud, flow control %s. Send 'ok' within %d s to keep\r\n",
+             baud_rate, flow_ctrl ? "on" : "off", UART_CONFIRM_TIMEOUT_MS / 1000);
+    send_msg(msg);
+
+    if (uart_handler_configure(baud_rate, flow_ctrl) == ESP_OK && wait_for_uart_confirm()) {
+        return true;
+    }
+
+    uart_handler_configure(settings->baud_rate, settings->flow_ctrl);
+    snprintf(msg, sizeof(msg), "No confirmation, reverted to %lu baud, flow control %s\r\n",
+             settings->baud_rate, settings->flow_ctrl ? "on" : "off");
+    send_msg(msg);
+    ESP_LOGW(TAG, "UART change to %lu baud not confirmed", baud_rate);
+    return false;
+}
+
+// Passed to every command handler by handle_input_command
+typedef struct {
+    const esp_partition_t* flash;
+    settings_t* settings;
+} command_ctx_t;
+
+static bool cmd_help(const cmd_table_args_t* args, void* ctx)
+{
+    cmd_table_print_help();
+    return false;
+}
+
+static bool cmd_start(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    if (settings->state == LOGGING) {
+        send_msg("Already logging\r\n");
+        return false;
+    }
+    adaptive_reset(&s_adaptive_state);
+    if (sampler_start(settings->logging_period_MS) != ESP_OK) {
+        send_msg("Error: Failed to start sampling\r\n");
+        return false;
+    }
+    settings->state = LOGGING;
+
+    log_settings_save(flash, settings);
+
+    send_msg("Started logging\r\n");
+    ESP_LOGI(TAG, "State changed to LOGGING");
+    return true;
+}
+
+static bool cmd_stop(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    if (settings->state == IDLE) {
+        send_msg("Already stopped\r\n");
+        return false;
+    }
+    settings->state = IDLE;
+    sampler_stop();
+
+    // Commit whatever the sampler produced before it stopped
+    log_storage_lock();
+    storage_drain_locked(flash);
+    log_storage_unlock();
+
+    log_settings_save(flash, settings);
+
+    send_msg("Stopped logging\r\n");
+    ESP_LOGI(TAG, "State changed to IDLE");
+    return true;
+}
+
+static bool cmd_info(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    char info_msg[1024];
+    uint32_t window_s = 0;
+    log_wear_t wear;
+    log_storage_lock();
+    log_storage_wear(flash, &wear);
+    uint32_t retained = log_storage_count();
+    uint32_t num_entries = retained + log_storage_pending();
+    uint32_t used_bytes = log_storage_used_bytes();
+    if (retained > 1) {
+        log_entry_t first, last;
+        log_read_entry(flash, 0, &first);
+        log_read_entry(flash, retained - 1, &last);
+        window_s = (uint32_t)((last.timestamp - first.timestamp) / 1000);
+    }
+    log_storage_unlock();
+
+    // Capacity of packed sectors depends on the data, estimate it from what is retained so far
+    uint32_t total_bytes = log_storage_size_bytes();
+    float bytes_per_entry = (retained > 0 && used_bytes > 0) ? (float)used_bytes / retained :
+                            (float)FLASH_SECTOR_SIZE / ENTRIES_PER_SECTOR;
+    uint32_t max_entries = (uint32_t)(total_bytes / bytes_per_entry);
+    if (max_entries < num_entries) max_entries = num_entries;
+    uint32_t remaining = max_entries - num_entries;
+    float percent_full = (float)used_bytes / total_bytes * 100.0f;
+
+    const char* state_str = (settings->state == IDLE) ? "IDLE" :
+                           (settings->state == LOGGING) ? "LOGGING" : "ERROR";
+    const char* level_str = "";
+    esp_log_level_t level = esp_log_level_get(TAG);
+    switch(level) {
+        case ESP_LOG_NONE: level_str = "NONE"; break;
+        case ESP_LOG_ERROR: level_str = "ERROR"; break;
+        case ESP_LOG_WARN: level_str = "WARN"; break;
+        case ESP_LOG_INFO: level_str = "INFO"; break;
+        case ESP_LOG_DEBUG: level_str = "DEBUG"; break;
+        case ESP_LOG_VERBOSE: level_str = "VERBOSE"; break;
+        default: level_str = "UNKNOWN"; break;
+    }
+
+    // e.g. "temperature C every 1, voltage mV every 10"
+    char channels[128];
+    int len = 0;
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT && len < (int)sizeof(channels); ch++) {
+        len += snprintf(channels + len, sizeof(channels) - len, "%s%s %s every %u", ch ? ", " : "",
+                        sensor_drivers[ch].name, sensor_drivers[ch].unit, settings->decimation[ch]);
+    }
+
+    // e.g. "deadband temperature 0.5 C, heartbeat 60000 ms, trigger temperature above 40 every 100 ms, 812 skipped"
+    const adaptive_config_t* adaptive = &settings->adaptive;
+    char adaptive_str[192];
+    len = snprintf(adaptive_str, sizeof(adaptive_str), "deadband");
+    bool deadband = false;
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT && len < (int)sizeof(adaptive_str); ch++) {
+        if (adaptive->deadband[ch] <= 0.0f) continue;
+        len += snprintf(adaptive_str + len, sizeof(adaptive_str) - len, "%s %s %g %s", deadband ? "," : "",
+                        sensor_drivers[ch].name, adaptive->deadband[ch], sensor_drivers[ch].unit);
+        deadband = true;
+    }
+    char trigger[96] = "off";
+    if (adaptive->trigger_mode != TRIGGER_OFF) {
+        snprintf(trigger, sizeof(trigger), "%s %s %g every %lu ms%s", sensor_drivers[adaptive->trigger_channel].name,
+                 trigger_mode_names[adaptive->trigger_mode], adaptive->trigger_level, adaptive->fast_period_ms,
+                 s_adaptive_state.fast ? " (holds)" : "");
+    }
+    if (len < (int)sizeof(adaptive_str)) {
+        snprintf(adaptive_str + len, sizeof(adaptive_str) - len, "%s, heartbeat %lu ms, trigger %s, %lu skipped",
+                 deadband ? "" : " off", adaptive->heartbeat_ms, trigger, s_adaptive_state.skipped);
+    }
+
+    snprintf(info_msg, sizeof(info_msg),
+        "\r\nSystem Information:\r\n"
+        "  Project: ESP_sample_sleep_project\r\n"
+        "  Logging period: %lu ms\r\n"
+        "  Current state: %s\r\n"
+        "  Entries logged: %lu / %lu\r\n"
+        "  Remaining space: %lu entries (%.1f%% full)\r\n"
+        "  Retained window: %lu s\r\n"
+        "  Clock: %llu ms (%s)\r\n"
+        "  Ring mode: %s\r\n"
+        "  Log format: %s (%.1f bytes/entry)\r\n"
+        "  Flash wear: %lu-%lu erases per log sector (mean %.1f), settings sector %lu\r\n"
+        "  Channels: %s\r\n"
+        "  Burst: %u reads per period\r\n"
+        "  Adaptive: %s\r\n"
+        "  UART: %lu baud, flow control %s\r\n"
+        "  Sleep mode: %s\r\n"
+        "  Log level: %s\r\n"
+        "  Dropped samples: %lu\r\n"
+        "  Missed deadlines: %lu\r\n"
+        "  Live stream: %s, %lu samples dropped\r\n\r\n",
+        settings->logging_period_MS,
+        state_str,
+        num_entries, max_entries,
+        remaining, percent_full,
+        window_s,
+        (unsigned long long)log_time_ms(), log_clock_is_wall() ? "Unix time" : "device time",
+        settings->ring_mode ? "on" : "off",
+        log_format_names[settings->log_format < 2 ? settings->log_format : 0], bytes_per_entry,
+        wear.min, wear.max, wear.mean, wear.settings,
+        channels,
+        s_burst,
+        adaptive_str,
+        settings->baud_rate, settings->flow_ctrl ? "on" : "off",
+        sleep_mode_names[settings->sleep_mode < 3 ? settings->sleep_mode : 0],
+        level_str,
+        s_dropped_entries + log_storage_get_stats()->dropped,
+        s_missed_deadlines,
+        stream_mode_names[s_stream_mode < 3 ? s_stream_mode : 0], s_stream_dropped);
+
+    send_msg(info_msg);
+    return false;
+}
+
+static bool cmd_set_period(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    uint32_t period = (uint32_t)args->num[0];
+    if (period < MIN_LOGGING_PERIOD_MS) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Error: Period must be >= %u ms\r\n", MIN_LOGGING_PERIOD_MS);
+        send_msg(msg);
+        return false;
+    }
+    if (settings->sleep_mode == SLEEP_DEEP && period < DEEP_SLEEP_MIN_PERIOD_MS) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Error: Deep sleep needs period >= %u ms\r\n", DEEP_SLEEP_MIN_PERIOD_MS);
+        send_msg(msg);
+        return false;
+    }
+    settings->logging_period_MS = period;
+    sampler_set_period(period);
+
+    log_settings_save(flash, settings);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Period set to %lu ms\r\n", period);
+    send_msg(msg);
+    ESP_LOGI(TAG, "Period changed to %lu ms", period);
+    return false;
+}
+
+static bool cmd_set_level(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    uint32_t level = (uint32_t)args->num[0];
+    if (level > 5) {
+        send_msg("Error: Level must be 0-5\r\n");
+        return false;
+    }
+    settings->log_level = (uint8_t)level;
+    log_level_set((esp_log_level_t)level);
+
+    log_settings_save(flash, settings);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Log level set to %lu\r\n", level);
+    send_msg(msg);
+    return false;
+}
+
+static bool cmd_set_ring(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    const char* arg = args->argv[0];
+    if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0) {
+        send_msg("Error: Ring mode must be on or off\r\n");
+        return false;
+    }
+    settings->ring_mode = (strcmp(arg, "on") == 0);
+
+    log_storage_lock();
+    log_set_ring_mode(settings->ring_mode);
+    log_storage_unlock();
+
+    log_settings_save(flash, settings);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Ring mode %s\r\n", settings->ring_mode ? "on" : "off");
+    send_msg(msg);
+    ESP_LOGI(TAG, "Ring mode %s", settings->ring_mode ? "on" : "off");
+    return false;
+}
+
+static bool cmd_set_sleep(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    const char* arg = args->argv[0];
+    uint8_t mode;
+    for (mode = 0; mode < 3; mode++) {
+        if (strcmp(arg, sleep_mode_names[mode]) == 0) break;
+    }
+    if (mode == 3) {
+        send_msg("Error: Sleep mode must be none, light or deep\r\n");
+        return false;
+    }
+    if (mode == SLEEP_DEEP && settings->logging_period_MS < DEEP_SLEEP_MIN_PERIOD_MS) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Error: Deep sleep needs period >= %u ms\r\n", DEEP_SLEEP_MIN_PERIOD_MS);
+        send_msg(msg);
+        return false;
+    }
+    if (mode == SLEEP_DEEP && settings->adaptive.trigger_mode != TRIGGER_OFF &&
+        settings->adaptive.fast_period_ms < DEEP_SLEEP_MIN_PERIOD_MS) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Error: Deep sleep needs trigger fast period >= %u ms\r\n", DEEP_SLEEP_MIN_PERIOD_MS);
+        send_msg(msg);
+        return false;
+    }
+    if (sleep_apply_mode(mode) != ESP_OK) {
+        send_msg("Error: Failed to configure sleep\r\n");
+        return false;
+    }
+    settings->sleep_mode = mode;
+
+    log_settings_save(flash, settings);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Sleep mode set to %s\r\n", sleep_mode_names[mode]);
+    send_msg(msg);
+    ESP_LOGI(TAG, "Sleep mode changed to %s", sleep_mode_names[mode]);
+    return false;
+}
+
+static bool cmd_set_format(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    const char* arg = args->argv[0];
+    uint8_t format;
+    for (format = 0; format < 2; format++) {
+        if (strcmp(arg, log_format_names[format]) == 0) break;
+    }
+    if (format == 2) {
+        send_msg("Error: Log format must be raw or packed\r\n");
+        return false;
+    }
+    settings->log_format = format;
 
-static uint32_t s_num_entries = 0;
-static uint32_t s_initial_timestamp_ms = 0;
+    log_storage_lock();
+    log_set_format(format);
+    log_storage_unlock();
 
-// Settings struct (stored at offset 0)
-typedef struct {
-    uint32_t magic;
-    uint32_t logging_period_MS;
-    uint8_t state;
-    uint8_t log_level;
-    uint8_t padding[2];
-} __attribute__((packed)) settings_t;
+    log_settings_save(flash, settings);
 
-// Log entry (stored after settings at LOG_START)
-typedef struct {
-    uint32_t timestamp;
-    float temperature;
-} __attribute__((packed)) log_entry_t;
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Log format set to %s from next sector\r\n", log_format_names[format]);
+    send_msg(msg);
+    ESP_LOGI(TAG, "Log format changed to %s", log_format_names[format]);
+    return false;
+}
 
-// Return next available log slot in partition after reset or power cycle 
-static uint32_t find_num_entries(const esp_partition_t* flash)
+// Channel by name or index, sends an error and returns -1 if there is none
+static int parse_channel(const char* arg)
 {
-    log_entry_t entry;
-    const uint32_t sector_size = 4096;
-    const uint32_t entries_per_sector = sector_size / sizeof(log_entry_t);
-    const uint32_t total_sectors = (flash->size - LOG_START) / sector_size;
-
-    // Step 1: Find which sector has empty space
-    uint32_t sector_count = 0;
-    for (uint32_t i = 0; i < total_sectors; i++) {
-        // Check last entry of this sector
-        uint32_t sector_offset = LOG_START + (i * sector_size);
-        uint32_t last_entry_offset = sector_offset + ((entries_per_sector - 1) * sizeof(log_entry_t));
-
-        esp_partition_read(flash, last_entry_offset, &entry, sizeof(log_entry_t));
-
-        // Check if sector has empty space
-        if (entry.timestamp == 0xFFFFFFFF) {
-            sector_count = i;
-            break;
-        }
-
-        sector_count = i + 1;
+    int ch;
+    for (ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        if (strcmp(arg, sensor_drivers[ch].name) == 0) break;
     }
-
-    // Check if flash is full
-    if (sector_count >= total_sectors) {
-        ESP_LOGW(TAG, "Flash full!");
-        return total_sectors * entries_per_sector;
+    if (ch == SENSOR_CHANNEL_COUNT && arg[0] >= '0' && arg[0] <= '9') {
+        ch = atoi(arg);
     }
+    if (ch < 0 || ch >= SENSOR_CHANNEL_COUNT) {
+        send_msg("Error: Unknown channel, see 'info'\r\n");
+        return -1;
+    }
+    return ch;
+}
 
-    // Find first empty entry within this sector
-    uint32_t sector_offset = LOG_START + (sector_count * sector_size);
-    uint32_t entry_count = 0;
-
-    for (uint32_t i = 0; i < entries_per_sector; i++) {
-        uint32_t offset = sector_offset + (i * sizeof(log_entry_t));
-        esp_partition_read(flash, offset, &entry, sizeof(log_entry_t));
+// Finite number in sensor units, the console only parses integers
+static bool parse_value(const char* arg, float* value)
+{
+    char* end;
+    *value = strtof(arg, &end);
+    return end != arg && *end == '\0' && isfinite(*value);
+}
 
-        if (entry.timestamp == 0xFFFFFFFF) {
-            entry_count = i;
-            break;
-        }
+static bool cmd_set_decimation(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    int ch = parse_channel(args->argv[0]);
+    if (ch < 0) {
+        return false;
+    }
+    uint32_t every = (uint32_t)args->num[1];
+    if (every < 1 || every > SENSOR_MAX_DECIMATION) {
+        send_msg("Error: Decimation must be 1-255\r\n");
+        return false;
     }
+    settings->decimation[ch] = (uint8_t)every;
+    s_decimation[ch] = (uint8_t)every;
 
-    uint32_t total_entries = (sector_count * entries_per_sector) + entry_count;
-    ESP_LOGI(TAG, "Found empty slot in sector %lu, entry %lu (total: %lu)",
-             sector_count, entry_count, total_entries);
+    log_settings_save(flash, settings);
 
-    return total_entries;
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Channel %s sampled every %lu periods\r\n", sensor_drivers[ch].name, every);
+    send_msg(msg);
+    ESP_LOGI(TAG, "Decimation of %s changed to %lu", sensor_drivers[ch].name, every);
+    return false;
 }
 
-esp_err_t erase_and_initialize_partition(const esp_partition_t* flash, settings_t* settings)
+static bool cmd_set_deadband(const cmd_table_args_t* args, void* ctx)
 {
-    esp_err_t err = esp_partition_erase_range(flash, 0, flash->size);
-    if (err != ESP_OK) {
-        return err;
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    int ch = parse_channel(args->argv[0]);
+    if (ch < 0) {
+        return false;
+    }
+    float band = 0.0f;
+    if (strcmp(args->argv[1], "off") != 0 && (!parse_value(args->argv[1], &band) || band < 0.0f)) {
+        send_msg("Error: Deadband must be a value >= 0 or off\r\n");
+        return false;
     }
+    settings->adaptive.deadband[ch] = band;
+    adaptive_config_set(&settings->adaptive);
 
-    settings->magic = SETTINGS_MAGIC;
-    settings->logging_period_MS = DEFAULT_LOGGING_PERIOD_MS;
-    settings->state = IDLE;
-    settings->log_level = ESP_LOG_INFO;
+    log_settings_save(flash, settings);
 
-    err = esp_partition_write(flash, 0, settings, sizeof(settings_t));
-    if (err != ESP_OK) {
-        return err;
+    char msg[80];
+    if (band > 0.0f) {
+        snprintf(msg, sizeof(msg), "Channel %s logged when it moves more than %g %s\r\n", sensor_drivers[ch].name,
+                 band, sensor_drivers[ch].unit);
+    } else {
+        snprintf(msg, sizeof(msg), "Channel %s logged every sample\r\n", sensor_drivers[ch].name);
     }
+    send_msg(msg);
+    ESP_LOGI(TAG, "Deadband of %s changed to %g", sensor_drivers[ch].name, band);
+    return false;
+}
 
-    s_num_entries = 0;
-    s_initial_timestamp_ms = (uint32_t)(esp_timer_get_time() / 1000);
+static bool cmd_set_heartbeat(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    uint32_t heartbeat = (uint32_t)args->num[0];
+    settings->adaptive.heartbeat_ms = heartbeat;
+    adaptive_config_set(&settings->adaptive);
 
-    // Set log level
-    esp_log_level_set(TAG, (esp_log_level_t)settings->log_level);
+    log_settings_save(flash, settings);
 
-    return ESP_OK;
+    char msg[64];
+    if (heartbeat) {
+        snprintf(msg, sizeof(msg), "Entry logged at least every %lu ms\r\n", heartbeat);
+    } else {
+        snprintf(msg, sizeof(msg), "Heartbeat off\r\n");
+    }
+    send_msg(msg);
+    ESP_LOGI(TAG, "Heartbeat changed to %lu ms", heartbeat);
+    return false;
 }
 
-bool handle_input_command(const command_t* cmd, const esp_partition_t* flash, settings_t* settings)
+static bool cmd_set_trigger(const cmd_table_args_t* args, void* ctx)
 {
-    if (strcmp(cmd->str, "help") == 0) {
-        const char* help_msg =
-            "Available commands:\r\n"
-            "  help - Show this help message\r\n"
-            "  start - Begin logging data\r\n"
-            "  stop - Stop logging data\r\n"
-            "  info - Show system information\r\n"
-            "  set period <ms> - Set logging period in milliseconds\r\n"
-            "  set level <0-5> - Set log level (0=none, 1=error, 2=warn, 3=info, 4=debug, 5=verbose)\r\n"
-            "  dump <count> - Print last <count> entries in CSV format (omit for all)\r\n"
-            "  clear <count> - Remove last <count> entries (omit for all)\r\n"
-            "  reset - Erase all data and reset to initial state\r\n";
-        send_msg(help_msg);
-        return false;
-
-    } else if (strcmp(cmd->str, "start") == 0) {
-        if (settings->state == LOGGING) {
-            send_msg("Already logging\r\n");
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    adaptive_config_t adaptive = settings->adaptive;
+    char msg[96];
+
+    if (strcmp(args->argv[0], "off") == 0) {
+        adaptive.trigger_mode = TRIGGER_OFF;
+    } else {
+        int ch = parse_channel(args->argv[0]);
+        if (ch < 0) {
             return false;
         }
-        settings->state = LOGGING;
-
-        // Must erase sector before writing
-        esp_partition_erase_range(flash, 0, 4096);
-        esp_partition_write(flash, 0, settings, sizeof(settings_t));
-
-        send_msg("Started logging\r\n");
-        ESP_LOGI(TAG, "State changed to LOGGING");
-        return true;
-
-    } else if (strcmp(cmd->str, "stop") == 0) {
-        if (settings->state == IDLE) {
-            send_msg("Already stopped\r\n");
+        uint8_t mode = TRIGGER_OFF;
+        float level;
+        if (args->argc >= 2 && strcmp(args->argv[1], "above") == 0) mode = TRIGGER_ABOVE;
+        if (args->argc >= 2 && strcmp(args->argv[1], "below") == 0) mode = TRIGGER_BELOW;
+        if (mode == TRIGGER_OFF || args->argc < 3 || !parse_value(args->argv[2], &level)) {
+            cmd_table_print_usage(args->cmd);
             return false;
         }
-        settings->state = IDLE;
-
-        esp_partition_erase_range(flash, 0, 4096);
-        esp_partition_write(flash, 0, settings, sizeof(settings_t));
-
-        send_msg("Stopped logging\r\n");
-        ESP_LOGI(TAG, "State changed to IDLE");
-        return true;
-
-    } else if (strcmp(cmd->str, "info") == 0) {
-        char info_msg[512];
-        uint32_t max_entries = (flash->size - LOG_START) / sizeof(log_entry_t);
-        uint32_t remaining = max_entries - s_num_entries;
-        float percent_full = (float)s_num_entries / max_entries * 100.0f;
-
-        const char* state_str = (settings->state == IDLE) ? "IDLE" :
-                               (settings->state == LOGGING) ? "LOGGING" : "ERROR";
-        const char* level_str = "";
-        esp_log_level_t level = esp_log_level_get(TAG);
-        switch(level) {
-            case ESP_LOG_NONE: level_str = "NONE"; break;
-            case ESP_LOG_ERROR: level_str = "ERROR"; break;
-            case ESP_LOG_WARN: level_str = "WARN"; break;
-            case ESP_LOG_INFO: level_str = "INFO"; break;
-            case ESP_LOG_DEBUG: level_str = "DEBUG"; break;
-            case ESP_LOG_VERBOSE: level_str = "VERBOSE"; break;
-            default: level_str = "UNKNOWN"; break;
-        }
-
-        snprintf(info_msg, sizeof(info_msg),
-            "\r\nSystem Information:\r\n"
-            "  Project: ESP_sample_sleep_project\r\n"
-            "  Logging period: %lu ms\r\n"
-            "  Current state: %s\r\n"
-            "  Entries logged: %lu / %lu\r\n"
-            "  Remaining space: %lu entries (%.1f%% full)\r\n"
-            "  Log level: %s\r\n\r\n",
-            settings->logging_period_MS,
-            state_str,
-            s_num_entries, max_entries,
-            remaining, percent_full,
-            level_str);
-
-        send_msg(info_msg);
-        return false;
-
-    } else if (strncmp(cmd->str, "set period ", 11) == 0) {
-        uint32_t period = atoi(cmd->str + 11);
-        if (period < MIN_LOGGING_PERIOD_MS) {
-            char msg[64];
-            snprintf(msg, sizeof(msg), "Error: Period must be >= %u ms\r\n", MIN_LOGGING_PERIOD_MS);
+        uint32_t fast_ms = (args->argc >= 4) ? (uint32_t)args->num[3] : adaptive.fast_period_ms;
+        uint32_t min_ms = (settings->sleep_mode == SLEEP_DEEP) ? DEEP_SLEEP_MIN_PERIOD_MS : MIN_LOGGING_PERIOD_MS;
+        if (fast_ms < min_ms) {
+            snprintf(msg, sizeof(msg), "Error: Fast period must be >= %lu ms%s\r\n", min_ms,
+                     (settings->sleep_mode == SLEEP_DEEP) ? " in deep sleep" : "");
             send_msg(msg);
             return false;
         }
-        settings->logging_period_MS = period;
+        adaptive.trigger_mode = mode;
+        adaptive.trigger_level = level;
+        adaptive.trigger_channel = (uint8_t)ch;
+        adaptive.fast_period_ms = fast_ms;
+    }
+
+    // The sampler picks up the new trigger and switches rate at its next sample
+    settings->adaptive = adaptive;
+    adaptive_config_set(&adaptive);
+
+    log_settings_save(flash, settings);
 
-        esp_partition_erase_range(flash, 0, 4096);
-        esp_partition_write(flash, 0, settings, sizeof(settings_t));
+    if (adaptive.trigger_mode == TRIGGER_OFF) {
+        send_msg("Trigger off\r\n");
+        ESP_LOGI(TAG, "Trigger turned off");
+    } else {
+        snprintf(msg, sizeof(msg), "Sampling every %lu ms while %s is %s %g %s\r\n", adaptive.fast_period_ms,
+                 sensor_drivers[adaptive.trigger_channel].name, trigger_mode_names[adaptive.trigger_mode],
+                 adaptive.trigger_level, sensor_drivers[adaptive.trigger_channel].unit);
+        send_msg(msg);
+        ESP_LOGI(TAG, "Trigger changed to %s %s %g", sensor_drivers[adaptive.trigger_channel].name,
+                 trigger_mode_names[adaptive.trigger_mode], adaptive.trigger_level);
+    }
+    return false;
+}
 
+static bool cmd_set_burst(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    uint32_t burst = (uint32_t)args->num[0];
+    if (burst < 1 || burst > SENSOR_MAX_BURST) {
         char msg[64];
-        snprintf(msg, sizeof(msg), "Period set to %lu ms\r\n", period);
+        snprintf(msg, sizeof(msg), "Error: Burst must be 1-%d\r\n", SENSOR_MAX_BURST);
         send_msg(msg);
-        ESP_LOGI(TAG, "Period changed to %lu ms", period);
         return false;
+    }
+    settings->burst = (uint8_t)burst;
+    s_burst = (uint8_t)burst;
 
-    } else if (strncmp(cmd->str, "set level ", 10) == 0) {
-        int level = atoi(cmd->str + 10);
-        if (level < 0 || level > 5) {
-            send_msg("Error: Level must be 0-5\r\n");
-            return false;
-        }
-        settings->log_level = (uint8_t)level;
-        esp_log_level_set(TAG, (esp_log_level_t)level);
+    log_settings_save(flash, settings);
 
-        esp_partition_erase_range(flash, 0, 4096);
-        esp_partition_write(flash, 0, settings, sizeof(settings_t));
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Burst set to %lu reads per period\r\n", burst);
+    send_msg(msg);
+    ESP_LOGI(TAG, "Burst changed to %lu", burst);
+    return false;
+}
+
+static bool cmd_set_time(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    uint64_t time_ms = args->num[0] * 1000;
+
+    // No sample may be stamped across the switch, restart the sampler once the clock is set
+    bool logging = settings->state == LOGGING;
+    if (logging) sampler_stop();
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint64_t newest_ms;
+    bool ok = log_set_time(flash, time_ms, &newest_ms) == ESP_OK;
+    log_storage_unlock();
+    if (logging) sampler_start(settings->logging_period_MS);
+
+    char msg[96];
+    if (!ok) {
+        snprintf(msg, sizeof(msg), "Error: Time must be after newest entry at %llu ms\r\n",
+                 (unsigned long long)newest_ms);
+        send_msg(msg);
+        return false;
+    }
+    snprintf(msg, sizeof(msg), "Clock set, log time is now %llu ms\r\n", (unsigned long long)time_ms);
+    send_msg(msg);
+    ESP_LOGI(TAG, "Clock set to %llu ms", (unsigned long long)time_ms);
+    return false;
+}
 
+static bool cmd_set_baud(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    uint32_t baud = (uint32_t)args->num[0];
+    if (baud < UART_HANDLER_MIN_BAUD || baud > UART_HANDLER_MAX_BAUD) {
         char msg[64];
-        snprintf(msg, sizeof(msg), "Log level set to %d\r\n", level);
+        snprintf(msg, sizeof(msg), "Error: Baud rate must be %u-%u\r\n",
+                 UART_HANDLER_MIN_BAUD, UART_HANDLER_MAX_BAUD);
         send_msg(msg);
         return false;
+    }
+    if (!uart_switch_confirmed(settings, baud, settings->flow_ctrl)) {
+        return false;
+    }
+    settings->baud_rate = baud;
 
-    } else if (strncmp(cmd->str, "dump", 4) == 0) {
-        uint32_t count = s_num_entries;
-        if (strlen(cmd->str) > 5) {
-            count = atoi(cmd->str + 5);
-            if (count > s_num_entries) count = s_num_entries;
-        }
+    log_settings_save(flash, settings);
 
-        send_msg("timestamp_ms,temperature_C\r\n");
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Baud rate set to %lu\r\n", baud);
+    send_msg(msg);
+    ESP_LOGI(TAG, "Baud rate changed to %lu", baud);
+    return false;
+}
 
-        uint32_t start_idx = (count >= s_num_entries) ? 0 : s_num_entries - count;
-        for (uint32_t i = start_idx; i < s_num_entries; i++) {
-            log_entry_t entry;
-            uint32_t offset = LOG_START + i * sizeof(log_entry_t);
-            esp_partition_read(flash, offset, &entry, sizeof(log_entry_t));
+static bool cmd_set_flow(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    const char* arg = args->argv[0];
+    if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0) {
+        send_msg("Error: Flow control must be on or off\r\n");
+        return false;
+    }
+    bool flow_ctrl = (strcmp(arg, "on") == 0);
+    if (!uart_switch_confirmed(settings, settings->baud_rate, flow_ctrl)) {
+        return false;
+    }
+    settings->flow_ctrl = flow_ctrl;
 
-            char line[64];
-            snprintf(line, sizeof(line), "%lu,%.2f\r\n", entry.timestamp, entry.temperature);
-            send_msg(line);
-        }
+    log_settings_save(flash, settings);
 
-        char msg[64];
-        snprintf(msg, sizeof(msg), "\r\nDumped %lu entries\r\n", count);
-        send_msg(msg);
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Flow control %s\r\n", flow_ctrl ? "on" : "off");
+    send_msg(msg);
+    return false;
+}
+
+static bool cmd_dumpbin(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    uint32_t from = (uint32_t)args->num[0];
+    uint32_t count = (uint32_t)args->num[1];
+    if (count == 0) count = UINT32_MAX;
+
+    // Info logs share UART0 with the frames, keep them out of the stream
+    esp_log_level_t level = (esp_log_level_t)settings->log_level;
+    log_level_set(level < ESP_LOG_WARN ? level : ESP_LOG_WARN);
+    uint32_t sent = dumpbin_send(flash, from, count);
+    log_level_set((esp_log_level_t)settings->log_level);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "\r\nDumped %lu entries\r\n", sent);
+    send_msg(msg);
+    return false;
+}
+
+static bool cmd_dump_rollup(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    uint32_t tier;
+    for (tier = 0; tier < ROLLUP_TIER_COUNT; tier++) {
+        if (strcmp(args->argv[0], rollup_tiers[tier].name) == 0) break;
+    }
+    uint64_t from_ms = 0;
+    uint64_t to_ms = UINT64_MAX;
+    if (tier == ROLLUP_TIER_COUNT || (args->argc > 1 && (strcmp(args->argv[1], "from") != 0 ||
+                                                         !parse_time_range(args, 2, &from_ms, &to_ms)))) {
+        cmd_table_print_usage(args->cmd);
         return false;
+    }
 
-    } else if (strncmp(cmd->str, "clear", 5) == 0) {
-        uint32_t count;
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t pos = log_storage_first();
+    uint32_t end = pos + log_storage_count();
+    log_storage_unlock();
+
+    // Buckets are built while reading, only the few rows of the overview cross the UART
+    static rollup_state_t rollup;
+    memset(&rollup, 0, sizeof(rollup));
+    rollup.bucket_ms = rollup_tiers[tier].bucket_ms;
+    rollup_send_header();
+    pos = log_locate_time(flash, pos, end, from_ms);
+    uint32_t count = log_scan(flash, pos, end, from_ms, to_ms, rollup_visit, &rollup);
+    rollup_flush(&rollup);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "\r\nDumped %lu buckets from %lu entries\r\n", rollup.buckets, count);
+    send_msg(msg);
+    return false;
+}
 
-        if (strlen(cmd->str) == 5) {
-            // Clear all entries
-            count = s_num_entries;
-        } else {
-            // Clear last N entries
-            count = atoi(cmd->str + 6);
-            if (count > s_num_entries) {
-                count = s_num_entries;
-            }
-        }
+static bool cmd_dump_splices(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t tail_seq, head_seq;
+    log_storage_sectors(&tail_seq, &head_seq);
+    uint32_t tail_first = log_storage_first();
+    log_storage_unlock();
+
+    // Splices always start a sector, the headers alone tell where they are
+    send_msg("entry,base_ms,clock\r\n");
+    uint32_t count = 0;
+    for (uint32_t seq = tail_seq; seq <= head_seq; seq++) {
+        sector_header_t header;
+        if (!log_read_sector_header(flash, seq, &header) || !(header.flags & SECTOR_FLAG_SPLICE) ||
+            header.first_index < tail_first) continue;
+        char line[64];
+        snprintf(line, sizeof(line), "%lu,%llu,%s\r\n", header.first_index - tail_first,
+                 (unsigned long long)header.base_ms, (header.flags & SECTOR_FLAG_WALL_CLOCK) ? "unix" : "device");
+        send_msg(line);
+        count++;
+    }
 
-        if (count == 0) {
-            send_msg("No entries to clear\r\n");
-            return false;
-        }
+    char msg[64];
+    snprintf(msg, sizeof(msg), "\r\nDumped %lu splices\r\n", count);
+    send_msg(msg);
+    return false;
+}
 
-        s_num_entries -= count;
+static bool cmd_dump_from(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    uint64_t from_ms, to_ms;
+    if (!parse_time_range(args, 0, &from_ms, &to_ms)) {
+        cmd_table_print_usage(args->cmd);
+        return false;
+    }
 
-        char msg[64];
-        snprintf(msg, sizeof(msg), "Removed last %lu entries (now %lu total)\r\n",
-                 count, s_num_entries);
-        send_msg(msg);
-        ESP_LOGI(TAG, "Logically removed %lu entries", count);
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t pos = log_storage_first();
+    uint32_t end = pos + log_storage_count();
+    log_storage_unlock();
+
+    // Only the sectors overlapping the range are read, start at the one holding from_ms
+    csv_send_header();
+    pos = log_locate_time(flash, pos, end, from_ms);
+    uint32_t count = log_scan(flash, pos, end, from_ms, to_ms, csv_visit, &s_dump_pipe);
+    tx_pipe_send(&s_dump_pipe);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "\r\nDumped %lu entries\r\n", count);
+    send_msg(msg);
+    return false;
+}
+
+static bool cmd_dump(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+
+    // Snapshot the head, entries below it are immutable so the sampler can keep running
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t num_entries = log_storage_count();
+    uint32_t tail_first = log_storage_first();
+    log_storage_unlock();
+
+    uint32_t count = args->argc ? (uint32_t)args->num[0] : num_entries;
+    if (count > num_entries) count = num_entries;
+
+    uint32_t start_idx = (count >= num_entries) ? 0 : num_entries - count;
+    csv_send_header();
+    count = log_scan(flash, tail_first + start_idx, tail_first + num_entries, 0, UINT64_MAX, csv_visit, &s_dump_pipe);
+    tx_pipe_send(&s_dump_pipe);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "\r\nDumped %lu entries\r\n", count);
+    send_msg(msg);
+    return false;
+}
+
+static bool cmd_stream(const cmd_table_args_t* args, void* ctx)
+{
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    const char* arg = args->argv[0];
+    const char* format = args->argc > 1 ? args->argv[1] : "csv";
+    uint32_t mode;
+    if (strcmp(arg, "off") == 0 && args->argc == 1) {
+        mode = STREAM_OFF;
+    } else if (strcmp(arg, "on") == 0 && strcmp(format, "csv") == 0) {
+        mode = STREAM_CSV;
+    } else if (strcmp(arg, "on") == 0 && strcmp(format, "binary") == 0) {
+        mode = STREAM_BINARY;
+    } else {
+        cmd_table_print_usage(args->cmd);
         return false;
+    }
 
-    } else if (strcmp(cmd->str, "reset") == 0) {
-        send_msg("Resetting and erasing all data...\r\n");
-        esp_err_t err = erase_and_initialize_partition(flash, settings);
-        if (err != ESP_OK) {
-            send_msg("Error: Reset failed\r\n");
-            ESP_LOGE(TAG, "Reset failed: %s", esp_err_to_name(err));
-        } else {
-            send_msg("Reset complete\r\n");
-            ESP_LOGI(TAG, "System reset");
-        }
+    // Stop teeing while the switch goes through the queue, so every entry after it is in the new mode
+    bool was_on = s_stream_mode != STREAM_OFF;
+    s_stream_mode = STREAM_OFF;
+    if (!was_on) {
+        s_stream_seq = 0;
+        s_stream_dropped = 0;
+    }
+    stream_item_t item = { .seq = s_stream_seq, .control = true, .mode = (uint8_t)mode };
+    xQueueSend(s_stream_queue, &item, portMAX_DELAY);
+    s_stream_mode = mode;
+
+    // Info logs share UART0 with binary frames, keep them out of the stream like dumpbin
+    esp_log_level_t level = (esp_log_level_t)settings->log_level;
+    log_level_set((mode == STREAM_BINARY && level > ESP_LOG_WARN) ? ESP_LOG_WARN : level);
+
+    char msg[80];
+    if (mode == STREAM_OFF) {
+        snprintf(msg, sizeof(msg), "Stream off, %lu samples dropped\r\n", s_stream_dropped);
+    } else {
+        snprintf(msg, sizeof(msg), "Streaming %s%s\r\n", stream_mode_names[mode],
+                 settings->state == LOGGING ? "" : ", samples follow once logging starts");
+    }
+    send_msg(msg);
+    return false;
+}
+
+static bool cmd_clear(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    uint32_t count;
+
+    log_storage_lock();
+    storage_drain_locked(flash);
+
+    // Clear last N entries, all if omitted
+    count = args->argc ? (uint32_t)args->num[0] : log_storage_count();
+    if (count > log_storage_count()) {
+        count = log_storage_count();
+    }
+
+    if (count == 0) {
+        log_storage_unlock();
+        send_msg("No entries to clear\r\n");
         return false;
+    }
+
+    log_truncate(flash, count);
+    uint32_t remaining = log_storage_count();
+    log_storage_unlock();
 
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Removed last %lu entries (now %lu total)\r\n",
+             count, remaining);
+    send_msg(msg);
+    ESP_LOGI(TAG, "Removed %lu entries", count);
+    return false;
+}
+
+static bool cmd_reset(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    send_msg("Resetting and erasing all data...\r\n");
+    sampler_stop();
+
+    // Discard pending entries, they belong to the log being erased
+    log_storage_lock();
+    xQueueReset(s_entry_queue);
+    esp_err_t err = erase_and_initialize_partition(flash, settings);
+    log_storage_unlock();
+    if (err != ESP_OK) {
+        send_msg("Error: Reset failed\r\n");
+        ESP_LOGE(TAG, "Reset failed: %s", esp_err_to_name(err));
     } else {
-        send_msg("Unknown command. Type 'help' for commands.\r\n");
+        send_msg("Reset complete\r\n");
+        ESP_LOGI(TAG, "System reset");
+        uart_handler_configure(settings->baud_rate, settings->flow_ctrl);
+    }
+    return false;
+}
+
+static void bench_visit(const log_entry_t* entry, void* ctx)
+{
+    (*(uint32_t*)ctx)++;
+}
+
+// Time a scan of every retained entry and a recovery-style pass over all sector headers, once
+// through esp_partition_read and once through the mapping
+static bool cmd_bench_read(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t pos = log_storage_first();
+    uint32_t end = pos + log_storage_count();
+    log_storage_unlock();
+
+    send_msg("path,entries,scan_us,ns_per_entry,header_scan_us\r\n");
+    for (int mapped = 0; mapped < 2; mapped++) {
+        if (!log_storage_use_map(mapped) && mapped) {
+            send_msg("mmap,unavailable\r\n");
+            break;
+        }
+
+        uint32_t visited = 0;
+        int64_t start_us = esp_timer_get_time();
+        log_scan(flash, pos, end, 0, UINT64_MAX, bench_visit, &visited);
+        int64_t scan_us = esp_timer_get_time() - start_us;
+
+        uint32_t newest;
+        start_us = esp_timer_get_time();
+        log_find_newest_sector(flash, &newest);
+        int64_t header_us = esp_timer_get_time() - start_us;
+
+        char line[96];
+        snprintf(line, sizeof(line), "%s,%lu,%lld,%lld,%lld\r\n", mapped ? "mmap" : "driver", visited,
+                 scan_us, visited ? scan_us * 1000 / visited : 0, header_us);
+        send_msg(line);
+    }
+    log_storage_use_map(true);
+    return false;
+}
+
+// Pipeline variants bench rate compares, the default configuration first
+typedef struct {
+    const char* name;
+    bool flush_each_entry;    // Commit every entry on its own instead of a page at a time
+    bool pre_erase;           // Erase task prepares the next sector ahead of the write head
+} bench_rate_variant_t;
+
+static const bench_rate_variant_t bench_rate_variants[] = {
+    { "batched", false, true },
+    { "unbatched", true, true },
+    { "no_pre_erase", false, false },
+};
+
+#define BENCH_RATE_VARIANT_COUNT (sizeof(bench_rate_variants) / sizeof(bench_rate_variants[0]))
+
+// Next shorter period of the ramp, about a quarter shorter each step and 1 ms steps at the end
+static uint32_t bench_rate_next(uint32_t period_ms)
+{
+    return period_ms > 4 ? period_ms * 3 / 4 : period_ms - 1;
+}
+
+// Entry number after the newest committed entry
+static uint32_t bench_log_end(void)
+{
+    return log_storage_first() + log_storage_count();
+}
+
+// Log samples entries at period_ms through the sampler and storage tasks, as `start` does, and send
+// one CSV row. Latency maxima are cleared first so they cover this step only. Returns whether every
+// deadline was met and every sample stored
+static bool bench_rate_step(const esp_partition_t* flash, const char* variant, uint32_t period_ms, uint32_t samples)
+{
+    log_storage_stats_t* storage = log_storage_get_stats();
+    stats_reset(&s_sample_late_stats);
+    stats_reset(&storage->write);
+    stats_reset(&storage->erase);
+    s_entry_queue_high = 0;
+    uint32_t missed = s_missed_deadlines;
+    uint32_t dropped = s_dropped_entries + storage->dropped;
+
+    log_storage_lock();
+    uint32_t end = bench_log_end();
+    log_storage_unlock();
+
+    if (sampler_start(period_ms) != ESP_OK) {
+        return false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(samples * period_ms));
+    sampler_stop();
+
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t logged = bench_log_end() - end;
+    log_storage_unlock();
+
+    missed = s_missed_deadlines - missed;
+    dropped = s_dropped_entries + storage->dropped - dropped;
+    uart_handler_printf("%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\r\n", variant, period_ms, logged, missed, dropped,
+                        s_sample_late_stats.max_us, storage->write.max_us, storage->erase.max_us, s_entry_queue_high);
+    return missed == 0 && dropped == 0;
+}
+
+// Ramp the sample period down per variant until a step misses a deadline or drops a sample. Steps
+// log real samples with the current channels, burst and format, which are removed again after each
+// variant, so the log must have room for one variant without reclaiming. Adaptive sampling is off
+static bool cmd_bench_rate(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    uint32_t start_ms = args->argc ? (uint32_t)args->num[0] : BENCH_RATE_START_MS;
+    char msg[80];
+    if (settings->state == LOGGING) {
+        send_msg("Error: Stop logging before bench rate\r\n");
+        return false;
+    }
+    if (start_ms < 1 || start_ms > BENCH_RATE_MAX_START_MS) {
+        snprintf(msg, sizeof(msg), "Error: Start period must be 1-%u ms\r\n", BENCH_RATE_MAX_START_MS);
+        send_msg(msg);
+        return false;
+    }
+
+    // Room for every step of a variant, commit records and the sector each truncate starts
+    uint32_t samples = BENCH_RATE_STEP_SECTORS * ENTRIES_PER_SECTOR;
+    uint32_t steps = 0;
+    for (uint32_t p = start_ms; p > 0; p = bench_rate_next(p)) steps++;
+    uint32_t needed = (steps * (BENCH_RATE_STEP_SECTORS + 1) + 1) * FLASH_SECTOR_SIZE;
+
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t free_bytes = log_storage_size_bytes() - log_storage_used_bytes();
+    log_storage_unlock();
+    if (free_bytes < needed) {
+        snprintf(msg, sizeof(msg), "Error: bench rate needs %lu KB free, clear entries first\r\n", needed / 1024);
+        send_msg(msg);
         return false;
     }
+
+    // Synchronous erases log at info level, keep them out of the rows and the timing
+    esp_log_level_t level = (esp_log_level_t)settings->log_level;
+    log_level_set(level < ESP_LOG_WARN ? level : ESP_LOG_WARN);
+    log_storage_stats_t* storage = log_storage_get_stats();
+    uint32_t missed = s_missed_deadlines;
+    uint32_t dropped = s_dropped_entries;
+    uint32_t storage_dropped = storage->dropped;
+    uint32_t min_period[BENCH_RATE_VARIANT_COUNT];
+
+    // Every sample is logged during the bench, the deadband would make steps log different amounts
+    adaptive_config_t adaptive = adaptive_config_get();
+    adaptive_state_t adaptive_state = s_adaptive_state;
+    adaptive_config_set(&(adaptive_config_t){ .trigger_mode = TRIGGER_OFF });
+    adaptive_reset(&s_adaptive_state);
+
+    send_msg("variant,period_ms,samples,missed,dropped,late_max_us,write_max_us,erase_max_us,queue_high\r\n");
+    for (size_t v = 0; v < BENCH_RATE_VARIANT_COUNT; v++) {
+        const bench_rate_variant_t* variant = &bench_rate_variants[v];
+        s_flush_each_entry = variant->flush_each_entry;
+        log_storage_set_pre_erase(variant->pre_erase);
+
+        log_storage_lock();
+        uint32_t end = bench_log_end();
+        log_storage_unlock();
+
+        min_period[v] = 0;
+        for (uint32_t p = start_ms; p > 0 && bench_rate_step(flash, variant->name, p, samples); p = bench_rate_next(p)) {
+            min_period[v] = p;
+        }
+        s_flush_each_entry = false;
+        log_storage_set_pre_erase(true);
+
+        // Every variant starts from the same log
+        log_storage_lock();
+        uint32_t logged = bench_log_end() - end;
+        if (logged > 0) log_truncate(flash, logged);
+        log_storage_unlock();
+    }
+
+    // The bench missed deadlines on purpose, they say nothing about logging
+    s_missed_deadlines = missed;
+    s_dropped_entries = dropped;
+    storage->dropped = storage_dropped;
+    adaptive_config_set(&adaptive);
+    s_adaptive_state = adaptive_state;
+    log_level_set(level);
+
+    send_msg("variant,min_period_ms,cpu_mhz\r\n");
+    for (size_t v = 0; v < BENCH_RATE_VARIANT_COUNT; v++) {
+        uart_handler_printf("%s,%lu,%d\r\n", bench_rate_variants[v].name, min_period[v], CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+    }
+    return false;
 }
 
+// Rates bench dump times, 0 fills the dump buffers without sending them, the ceiling that reading,
+// decoding and formatting set
+static const uint32_t bench_dump_bauds[] = { 0, 115200, 230400, 460800, 921600, 2000000 };
+
+#define BENCH_DUMP_BAUD_COUNT (sizeof(bench_dump_bauds) / sizeof(bench_dump_bauds[0]))
+
+// Time dump and dumpbin of the newest count entries at each rate, until the last byte left the UART.
+// The host only reads output at the configured rate, results are sent once the UART is back at it
+static bool cmd_bench_dump(const cmd_table_args_t* args, void* ctx)
+{
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t num_entries = log_storage_count();
+    uint32_t tail_first = log_storage_first();
+    log_storage_unlock();
+
+    uint32_t count = args->argc ? (uint32_t)args->num[0] : num_entries;
+    if (count > num_entries) count = num_entries;
+    uint32_t from = num_entries - count;
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "Timing dumps of %lu entries, output is unreadable until the results at %lu baud\r\n",
+             count, settings->baud_rate);
+    send_msg(msg);
+
+    struct {
+        uint32_t entries;
+        uint32_t bytes;
+        int64_t us;
+    } results[2][BENCH_DUMP_BAUD_COUNT];
+
+    esp_log_level_t level = (esp_log_level_t)settings->log_level;
+    log_level_set(level < ESP_LOG_WARN ? level : ESP_LOG_WARN);
+    for (int binary = 0; binary < 2; binary++) {
+        for (size_t i = 0; i < BENCH_DUMP_BAUD_COUNT; i++) {
+            uint32_t baud = bench_dump_bauds[i];
+            if (baud) {
+                uart_handler_configure(baud, settings->flow_ctrl);
+            }
+            s_dump_pipe.discard = (baud == 0);
+            s_dump_pipe.bytes = 0;
+
+            int64_t start_us = esp_timer_get_time();
+            uint32_t entries;
+            if (binary) {
+                entries = dumpbin_send(flash, from, count);
+            } else {
+                entries = log_scan(flash, tail_first + from, tail_first + num_entries, 0, UINT64_MAX,
+                                   csv_visit, &s_dump_pipe);
+                tx_pipe_send(&s_dump_pipe);
+            }
+            uart_handler_drain(portMAX_DELAY);
+            results[binary][i].us = esp_timer_get_time() - start_us;
+            results[binary][i].entries = entries;
+            results[binary][i].bytes = s_dump_pipe.bytes;
+        }
+    }
+    s_dump_pipe.discard = false;
+    uart_handler_configure(settings->baud_rate, settings->flow_ctrl);
+    log_level_set(level);
+
+    // line_pct is the share of the dump time the bytes need on the wire at 8N1, 100 when the UART is the limit
+    send_msg("\r\nformat,baud,entries,bytes,dump_us,bytes_per_s,line_pct\r\n");
+    for (int binary = 0; binary < 2; binary++) {
+        for (size_t i = 0; i < BENCH_DUMP_BAUD_COUNT; i++) {
+            uint32_t baud = bench_dump_bauds[i];
+            uint32_t bytes = results[binary][i].bytes;
+            int64_t us = results[binary][i].us > 0 ? results[binary][i].us : 1;
+            char pct[12] = "";
+            if (baud) {
+                snprintf(pct, sizeof(pct), "%llu", (unsigned long long)bytes * 10 * 1000000 / baud * 100 / us);
+            }
+            uart_handler_printf("%s,%lu,%lu,%lu,%lld,%llu,%s\r\n", binary ? "binary" : "csv", baud,
+                                results[binary][i].entries, bytes, us, (unsigned long long)bytes * 1000000 / us, pct);
+        }
+    }
+    return false;
+}
 
-esp_err_t log_data_entry(const esp_partition_t* flash, log_entry_t* entry)
+// Time recovery the way boot runs it, from the newest checkpoint, and the pass over every sector header
+// it falls back to without one. Staged entries are committed first, so each run finds the same log
+static bool cmd_bench_recover(const cmd_table_args_t* args, void* ctx)
 {
-    esp_err_t err = ESP_OK;
-    uint32_t entry_offset = LOG_START + s_num_entries * sizeof(log_entry_t);
+    const esp_partition_t* flash = ((command_ctx_t*)ctx)->flash;
+    settings_t* settings = ((command_ctx_t*)ctx)->settings;
+    stats_op_t boot, recover, header_scan;
+    stats_reset(&boot);
+    stats_reset(&recover);
+    stats_reset(&header_scan);
+    if (s_boot_recover_us >= 0) {
+        stats_record(&boot, (uint32_t)s_boot_recover_us);
+    }
+
+    // Recovery reports what it found at info level on every run
+    esp_log_level_t level = (esp_log_level_t)settings->log_level;
+    log_level_set(level < ESP_LOG_WARN ? level : ESP_LOG_WARN);
+
+    log_storage_lock();
+    storage_drain_locked(flash);
+    uint32_t before = log_storage_count();
+    uint32_t recovered = before;
+    for (int i = 0; i < BENCH_RECOVER_RUNS; i++) {
+        int64_t start_us = esp_timer_get_time();
+        recovered = log_storage_recover(flash, settings->ring_mode, settings->log_format);
+        stats_record(&recover, (uint32_t)(esp_timer_get_time() - start_us));
+
+        uint32_t newest;
+        start_us = esp_timer_get_time();
+        log_find_newest_sector(flash, &newest);
+        stats_record(&header_scan, (uint32_t)(esp_timer_get_time() - start_us));
+    }
+    uint32_t tail_seq, head_seq;
+    log_storage_sectors(&tail_seq, &head_seq);
+    log_storage_unlock();
+    log_level_set(level);
+
+    uart_handler_printf("op,count,min_us,mean_us,max_us,histogram\r\n");
+    const struct { const char* name; const stats_op_t* op; } ops[] = {
+        { "recover_boot", &boot },
+        { "recover", &recover },
+        { "header_scan", &header_scan },
+    };
+    char line[UART_HANDLER_POOL_BUF_SIZE];
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        int len = stats_format(line, sizeof(line) - 2, ops[i].name, ops[i].op);
+        memcpy(line + len, "\r\n", 2);
+        uart_handler_send(line, len + 2);
+    }
+    uart_handler_printf("entries,recovered,sectors,partition_sectors\r\n%lu,%lu,%lu,%lu\r\n", before, recovered,
+                        head_seq - tail_seq + 1, log_storage_size_bytes() / FLASH_SECTOR_SIZE);
+    return false;
+}
 
-    // Erase sector if this is the first entry in it
-    if (entry_offset % 4096 == 0) {
-        ESP_LOGI(TAG, "Erasing sector at offset %lu", entry_offset);
-        err = esp_partition_erase_range(flash, entry_offset, 4096);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to erase sector: %s", esp_err_to_name(err));
-            return err;
+static bool cmd_stats(const cmd_table_args_t* args, void* ctx)
+{
+    uart_handler_stats_t* uart = uart_handler_get_stats();
+    log_storage_stats_t* storage = log_storage_get_stats();
+    if (args->argc > 0) {
+        if (strcmp(args->argv[0], "reset") != 0) {
+            cmd_table_print_usage(args->cmd);
+            return false;
         }
+        stats_reset(&storage->erase);
+        stats_reset(&storage->write);
+        stats_reset(&s_sample_late_stats);
+        stats_reset(&uart->tx);
+        for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+            stats_reset(sensors_read_stats(ch));
+        }
+        s_missed_deadlines = 0;
+        s_dropped_entries = 0;
+        storage->dropped = 0;
+        s_stream_dropped = 0;
+        uart->rx_overflows = 0;
+        s_entry_queue_high = 0;
+        s_stream_queue_high = 0;
+        uart->tx_queue_high = 0;
+        s_storage_wakes = 0;
+        send_msg("Stats reset\r\n");
+        return false;
     }
 
-    // Write entry
-    err = esp_partition_write(flash, entry_offset, entry, sizeof(log_entry_t));
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to write entry: %s", esp_err_to_name(err));
-        return err;
+    // One pooled TX buffer per line, a full histogram line is truncated to the buffer size
+    uart_handler_printf("op,count,min_us,mean_us,max_us,histogram\r\n");
+    const struct { const char* name; const stats_op_t* op; } ops[] = {
+        { "flash_erase", &storage->erase },
+        { "flash_write", &storage->write },
+        { "sample_late", &s_sample_late_stats },
+        { "uart_tx", &uart->tx },
+    };
+    char line[UART_HANDLER_POOL_BUF_SIZE];
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        int len = stats_format(line, sizeof(line) - 2, ops[i].name, ops[i].op);
+        memcpy(line + len, "\r\n", 2);
+        uart_handler_send(line, len + 2);
+    }
+    for (int ch = 0; ch < SENSOR_CHANNEL_COUNT; ch++) {
+        char name[32];
+        snprintf(name, sizeof(name), "read_%s", sensor_drivers[ch].name);
+        int len = stats_format(line, sizeof(line) - 2, name, sensors_read_stats(ch));
+        memcpy(line + len, "\r\n", 2);
+        uart_handler_send(line, len + 2);
     }
 
-    ESP_LOGI(TAG, "Wrote entry at offset %lu", entry_offset);
+    uart_handler_printf("counter,value,limit\r\n"
+                        "missed_deadlines,%lu,\r\n"
+                        "dropped_samples,%lu,\r\n"
+                        "stream_dropped,%lu,\r\n"
+                        "uart_rx_overflows,%lu,\r\n"
+                        "entry_queue_high,%lu,%d\r\n"
+                        "stream_queue_high,%lu,%d\r\n"
+                        "uart_tx_queue_high,%lu,%d\r\n"
+                        "storage_wakes,%lu,\r\n",
+                        s_missed_deadlines, s_dropped_entries + storage->dropped, s_stream_dropped, uart->rx_overflows,
+                        s_entry_queue_high, ENTRY_QUEUE_LEN, s_stream_queue_high, STREAM_QUEUE_LEN,
+                        uart->tx_queue_high, TX_QUEUE_SIZE, s_storage_wakes);
+    return false;
+}
+
+// Help lists commands in this order, lookup does not depend on it
+static const cmd_table_command_t s_commands[] = {
+    { "help", "", NULL, "Show this help message", cmd_help },
+    { "start", "", NULL, "Begin logging data", cmd_start },
+    { "stop", "", NULL, "Stop logging data", cmd_stop },
+    { "info", "", NULL, "Show system information", cmd_info },
+    { "set period", "u", "<ms>", "Set logging period in milliseconds", cmd_set_period },
+    { "set level", "u", "<0-5>", "Set log level (0=none, 1=error, 2=warn, 3=info, 4=debug, 5=verbose)", cmd_set_level },
+    { "set ring", "s", "<on|off>", "Overwrite oldest data when flash is full instead of stopping", cmd_set_ring },
+    { "set baud", "u", "<rate>", "Change UART baud rate, confirm with 'ok' at the new rate", cmd_set_baud },
+    { "set flow", "s", "<on|off>", "RTS/CTS hardware flow control, confirm with 'ok'", cmd_set_flow },
+    { "set sleep", "s", "<none|light|deep>", "Sleep between samples, deep needs period >= 1000 ms", cmd_set_sleep },
+    { "set format", "s", "<raw|packed>", "Log format of new sectors, packed stores ~4x more entries", cmd_set_format },
+    { "set decimation", "su", "<channel> <1-255>", "Sample a channel every Nth period, name or index", cmd_set_decimation },
+    { "set deadband", "ss", "<channel> <value|off>", "Log a channel only once it moves more than value from its last logged value", cmd_set_deadband },
+    { "set heartbeat", "u", "<ms>", "Log an entry at least this often while the deadband skips samples, 0 for never", cmd_set_heartbeat },
+    { "set trigger", "sSSU", "<channel|off> [above|below] [level] [fast ms]", "Sample and log every fast ms while a channel is past level", cmd_set_trigger },
+    { "set burst", "u", "<1-64>", "Reads per channel and period, stored as one aggregate entry", cmd_set_burst },
+    { "set time", "u", "<unix seconds>", "Stamp new entries with wall clock time, must be after the newest entry", cmd_set_time },
+    { "dump", "U", "[count]", "Print last count entries in CSV format, all if omitted", cmd_dump },
+    { "dump from", "qSQ", "<ms> [to <ms>]", "Print entries stamped within a time range, all newer if to is omitted", cmd_dump_from },
+    { "dump rollup", "sSQSQ", "<1m|1h|1d> [from <ms> [to <ms>]]", "Print min/max/mean/count per minute, hour or day", cmd_dump_rollup },
+    { "dump splices", "", NULL, "List where the log time jumps, after a power loss or set time", cmd_dump_splices },
+    { "dumpbin", "UU", "[from] [count]", "Stream entries as binary frames, see tools/dumpbin_decode.py, all if omitted", cmd_dumpbin },
+    { "stream", "sS", "<on|off> [csv|binary]", "Print new samples live while logging, binary as dumpbin frames", cmd_stream },
+    { "clear", "U", "[count]", "Remove last count entries, all if omitted", cmd_clear },
+    { "reset", "", NULL, "Erase all data and reset to initial state", cmd_reset },
+    { "stats", "S", "[reset]", "Show operation latencies, histograms and counters, or clear them", cmd_stats },
+    { "bench read", "", NULL, "Time a full log scan and header scan through the driver and through mmap", cmd_bench_read },
+    { "bench rate", "U", "[start ms]", "Lower the sample period until deadlines are missed, with and without batching and pre-erase", cmd_bench_rate },
+    { "bench dump", "U", "[count]", "Time CSV and binary dumps of the last count entries at several baud rates, all if omitted", cmd_bench_dump },
+    { "bench recover", "", NULL, "Time log recovery at boot, from the checkpoint and by a full header scan", cmd_bench_recover },
+};
+
+bool handle_input_command(const command_t* cmd, const esp_partition_t* flash, settings_t* settings)
+{
+    command_ctx_t ctx = { .flash = flash, .settings = settings };
+    return cmd_table_dispatch(cmd->str, &ctx);
+}
 
-    s_num_entries++;
+#if EXT_FLASH_ENABLE
+// Bring up the external SPI NOR chip and register all of it as a data partition
+static esp_err_t ext_flash_register(void)
+{
+    spi_bus_config_t bus = {
+        .mosi_io_num = EXT_FLASH_PIN_MOSI,
+        .miso_io_num = EXT_FLASH_PIN_MISO,
+        .sclk_io_num = EXT_FLASH_PIN_CLK,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+    };
+    esp_flash_spi_device_config_t device = {
+        .host_id = EXT_FLASH_HOST,
+        .cs_id = 0,
+        .cs_io_num = EXT_FLASH_PIN_CS,
+        .io_mode = SPI_FLASH_DIO,
+        .freq_mhz = EXT_FLASH_FREQ_MHZ,
+    };
+    esp_flash_t* chip;
+    uint32_t size;
+    const esp_partition_t* partition;
+
+    esp_err_t err = spi_bus_initialize(EXT_FLASH_HOST, &bus, SPI_DMA_CH_AUTO);
+    if (err == ESP_OK) err = spi_bus_add_flash_device(&chip, &device);
+    if (err == ESP_OK) err = esp_flash_init(chip);
+    if (err == ESP_OK) err = esp_flash_get_size(chip, &size);
+    if (err == ESP_OK) {
+        err = esp_partition_register_external(chip, 0, size, EXT_FLASH_LABEL, ESP_PARTITION_TYPE_DATA, 0x40, &partition);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "External flash not available: %s", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "External flash: %lu bytes", size);
     return ESP_OK;
 }
+#endif
 
+// Every further data partition of subtype 0x40 continues the log after the storage partition, in table order
+static void add_log_partitions(const esp_partition_t* flash)
+{
+    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_DATA, 0x40, NULL);
+    for (; it != NULL; it = esp_partition_next(it)) {
+        const esp_partition_t* partition = esp_partition_get(it);
+        if (partition == flash) {
+            continue;
+        }
+        if (partition->encrypted) {
+            ESP_LOGW(TAG, "Partition %s is encrypted, not used for the log", partition->label);
+            continue;
+        }
+        log_backend_t backend;
+        log_backend_partition(partition, &backend);
+        if (log_storage_add_backend(&backend) != ESP_OK) {
+            ESP_LOGW(TAG, "Partition %s not used for the log", partition->label);
+            continue;
+        }
+        ESP_LOGI(TAG, "Log continues on partition %s: size=%lu bytes", partition->label, partition->size);
+    }
+}
 
 void app_main(void)
 {
@@ -366,74 +2295,129 @@ void app_main(void)
     }
 
     ESP_LOGI(TAG, "Flash: address=0x%lx, size=%lu bytes", flash->address, flash->size);
+#if EXT_FLASH_ENABLE
+    // A missing chip would move log sectors, stop instead of re-initializing over the log
+    if (ext_flash_register() != ESP_OK) {
+        return;
+    }
+#endif
+    add_log_partitions(flash);
+    if (log_storage_init(flash, sizeof(settings_t)) != ESP_OK) {
+        return;
+    }
+
+    // Timer wakeup from deep sleep only takes a sample, skips settings, recovery, UART and tasks
+    if (sleep_state_valid() && esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
+        deep_sleep_sample(flash);
+    }
+
+    log_storage_map(flash);
 
     settings_t settings;
-    esp_partition_read(flash, 0, &settings, sizeof(settings_t));
+    esp_err_t err = log_settings_load(flash, &settings);
+
+    // A power cut while the journal sector is compacted loses every record, keep the log rather than format it
+    if (err == ESP_ERR_NOT_FOUND && log_storage_has_log(flash)) {
+        ESP_LOGW(TAG, "Settings lost, recovering the log with default settings");
+        settings_defaults(&settings);
+        err = log_settings_reset(flash, &settings);
+    }
 
-    // Check magic number to detect first boot
-    if (settings.magic != SETTINGS_MAGIC) {
+    // Check magic number to detect first boot, a different sensor table also changes the record layout
+    if (err == ESP_OK && settings.magic == SETTINGS_MAGIC && settings.sensor_layout != sensors_layout_id()) {
+        ESP_LOGW(TAG, "Sensor channels changed, existing log cannot be read with this firmware");
+        err = ESP_ERR_INVALID_VERSION;
+    }
+    if (err == ESP_OK && settings.magic == SETTINGS_MAGIC &&
+        settings.log_sectors != log_storage_size_bytes() / FLASH_SECTOR_SIZE) {
+        ESP_LOGW(TAG, "Log storage changed from %lu to %lu sectors, existing log cannot be read",
+                 settings.log_sectors, log_storage_size_bytes() / FLASH_SECTOR_SIZE);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    adaptive_reset(&s_adaptive_state);
+    if (err != ESP_OK || settings.magic != SETTINGS_MAGIC) {
         ESP_LOGI(TAG, "First boot - erasing partition and initializing");
 
         if (erase_and_initialize_partition(flash, &settings) != ESP_OK) {
             ESP_LOGE(TAG, "Failed to initialize partition");
             return;
         }
-        
+        log_clock_restore(flash);
+
     } else {
         ESP_LOGI(TAG, "Continuing from previous session (period=%lu, state=%u)",
                  settings.logging_period_MS, settings.state);
 
         // Restore log level from flash
-        esp_log_level_set(TAG, (esp_log_level_t)settings.log_level);
-
-        s_num_entries = find_num_entries(flash);
-        ESP_LOGI(TAG, "Current number of entries: %lu", s_num_entries);
-
-        // Read last timestamp and set initial timestamp ahead to mark data splice
-        if (s_num_entries > 0) {
-            log_entry_t last_entry;
-            uint32_t last_offset = LOG_START + (s_num_entries - 1) * sizeof(log_entry_t);
-            esp_partition_read(flash, last_offset, &last_entry, sizeof(log_entry_t));
-
-            // Set initial timestamp ahead of last entry to mark splice
-            s_initial_timestamp_ms = last_entry.timestamp + DATA_SPLICE_GAP_MS;
-            ESP_LOGI(TAG, "Last timestamp: %lu ms, new initial: %lu ms",
-                     last_entry.timestamp, s_initial_timestamp_ms);
-        } else {
-            s_initial_timestamp_ms = (uint32_t)(esp_timer_get_time() / 1000);
+        log_level_set((esp_log_level_t)settings.log_level);
+        int64_t start_us = esp_timer_get_time();
+        uint32_t num_entries = log_storage_recover(flash, settings.ring_mode, settings.log_format);
+        s_boot_recover_us = esp_timer_get_time() - start_us;
+        ESP_LOGI(TAG, "Current number of entries: %lu", num_entries);
+
+        log_clock_restore(flash);
+
+        if (sleep_state_valid()) {
+            // Woken from deep sleep by BOOT button, log time ran on in RTC
+            s_dropped_entries = s_sleep_state.dropped_entries;
+            log_storage_get_stats()->dropped = s_sleep_state.storage.dropped;
+            s_missed_deadlines = s_sleep_state.missed_deadlines;
+            s_adaptive_state = s_sleep_state.adaptive;
+            s_sleep_state.magic = 0;
+            ESP_LOGI(TAG, "Woke from deep sleep, continuing at %llu ms", (unsigned long long)log_time_ms());
         }
     }
 
     // Initialize UART
-    ESP_ERROR_CHECK_WITHOUT_ABORT(uart_handler_init());
+    ESP_ERROR_CHECK_WITHOUT_ABORT(uart_handler_init(settings.baud_rate, settings.flow_ctrl));
+    cmd_table_init(send_msg);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(cmd_table_register_table(s_commands, sizeof(s_commands) / sizeof(s_commands[0])));
+    if (settings.sleep_mode != SLEEP_NONE) {
+        sleep_apply_mode(settings.sleep_mode);
+    }
     QueueHandle_t q = uart_handler_get_queue();
     command_t cmd;
 
-    // Initialize temperature sensor
-    temperature_sensor_handle_t temp_sensor = NULL;
-    temperature_sensor_config_t temp_config = {
-        .range_min = -10,
-        .range_max = 80,
-        .clk_src = 0
-    };
+    // Initialize sensor channels, a failed channel is logged as missing values
+    memcpy(s_decimation, settings.decimation, sizeof(s_decimation));
+    adaptive_config_set(&settings.adaptive);
+    if (settings.burst == 0) settings.burst = SENSOR_DEFAULT_BURST;
+    s_burst = settings.burst;
+    if (sensors_init() != ESP_OK) {
+        send_msg("Error: Sensor init failed, see log for channel\r\n");
+    } else {
+        ESP_LOGI(TAG, "%d sensor channels initialized", SENSOR_CHANNEL_COUNT);
+    }
 
-    esp_err_t err = temperature_sensor_install(&temp_config, &temp_sensor);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to install temp sensor: %s", esp_err_to_name(err));
-        send_msg("Error: Temperature sensor init failed\r\n");
+    // Sampler and storage tasks
+    s_entry_queue = xQueueCreate(ENTRY_QUEUE_LEN, sizeof(log_entry_t));
+    s_stream_queue = xQueueCreate(STREAM_QUEUE_LEN, sizeof(stream_item_t));
+    s_dump_pipe.free = xSemaphoreCreateCounting(2, 2);
+    if (!s_entry_queue || !s_stream_queue || !s_dump_pipe.free) {
+        ESP_LOGE(TAG, "Failed to allocate sampler resources");
         return;
     }
 
-    err = temperature_sensor_enable(temp_sensor);
+    const esp_timer_create_args_t timer_args = {
+        .callback = sample_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "sample"
+    };
+    err = esp_timer_create(&timer_args, &s_sample_timer);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to enable temp sensor: %s", esp_err_to_name(err));
-        send_msg("Error: Temperature sensor enable failed\r\n");
+        ESP_LOGE(TAG, "Failed to create sample timer: %s", esp_err_to_name(err));
         return;
     }
 
-    ESP_LOGI(TAG, "Temperature sensor initialized");
+    xTaskCreate(sampler_task, "sampler", 4096, NULL, SAMPLER_TASK_PRIORITY, &s_sampler_task);
+    xTaskCreate(storage_task, "storage", 4096, (void*)flash, STORAGE_TASK_PRIORITY, &s_storage_task);
+    log_storage_start(flash, ERASE_TASK_PRIORITY);
+    xTaskCreate(stream_task, "stream", 4096, NULL, STREAM_TASK_PRIORITY, NULL);
 
-    uint32_t start_time_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    // Resume logging that was active before power cycle
+    if (settings.state == LOGGING && sampler_start(settings.logging_period_MS) != ESP_OK) {
+        settings.state = ERROR;
+    }
 
     for (;;) {
         switch (settings.state) {
@@ -443,35 +2427,18 @@ void app_main(void)
             while (xQueueReceive(q, &cmd, portMAX_DELAY)) {
                 if (handle_input_command(&cmd, flash, &settings)) break;
             }
-            // Reset start time when leaving IDLE
-            start_time_ms = (uint32_t)(esp_timer_get_time() / 1000);
             break;
 
         case LOGGING:
-            // Check for commands (non-blocking)
-            if (xQueueReceive(q, &cmd, 0)) {
-                handle_input_command(&cmd, flash, &settings);
-            }
-
-            // Read temperature
-            float temperature;
-            err = temperature_sensor_get_celsius(temp_sensor, &temperature);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to read temperature: %s", esp_err_to_name(err));
-                temperature = 99.9f;  // Use 99.9f on error
+            // Sampling runs on its own schedule in sampler_task, only commands are handled here
+            ESP_LOGI(TAG, "State: LOGGING, sampling every %lu ms", settings.logging_period_MS);
+            for (;;) {
+                TickType_t wait = deep_sleep_allowed(&settings) ? pdMS_TO_TICKS(DEEP_SLEEP_CONSOLE_MS) : portMAX_DELAY;
+                if (xQueueReceive(q, &cmd, wait) != pdTRUE) {
+                    deep_sleep_enter(flash, &settings);  // Console idle, does not return
+                }
+                if (handle_input_command(&cmd, flash, &settings) || settings.state != LOGGING) break;
             }
-
-            // Calculate relative timestamp
-            uint32_t relative_ms = (uint32_t)(esp_timer_get_time() / 1000) - start_time_ms;
-            uint32_t timestamp = s_initial_timestamp_ms + relative_ms;
-
-            // Log entry
-            log_data_entry(flash, &(log_entry_t){
-                .timestamp = timestamp,
-                .temperature = temperature
-            });
-
-            vTaskDelay(pdMS_TO_TICKS(settings.logging_period_MS));
             break;
 
         case ERROR:
@@ -489,7 +2456,7 @@ void app_main(void)
         default:
             ESP_LOGE(TAG, "Unknown state %u, resetting to IDLE", settings.state);
             settings.state = IDLE;
-            esp_partition_write(flash, 0, &settings, sizeof(settings_t));
+            log_settings_save(flash, &settings);
             break;
         }
     }
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""Decode output of the `dumpbin` command into CSV.
+
+Reads either a raw capture file (e.g. from `minicom --capturefile`) or talks to
+the device directly over a serial port (requires pyserial):
+
+    python tools/dumpbin_decode.py capture.bin > data.csv
+    python tools/dumpbin_decode.py --port /dev/ttyUSB0 [--from N] [--count N] > data.csv
+
+Frame layout (little endian), see dumpbin_header_t in ESP_sample_sleep_project.c:
+
+    u32 magic "DBIN" | u8 version | u8 entry_size | u16 length | u32 first_index
+    length bytes of entries | u32 CRC32 over header and payload
+
+Version 3 entries are a u64 timestamp followed by one float per sensor channel,
+NaN for a channel that was not sampled. The dump starts with a schema frame
+(entry_size 0) whose payload is the CSV header naming the channels. Version 2
+entries have a u32 timestamp, version 1 entries are a timestamp and a single
+temperature. A frame with length 0 ends the dump. Bytes outside frames (echo, text, logs)
+are skipped, frames with a bad CRC are reported and dropped.
+
+A capture of `stream on binary` decodes the same way, its frames are indexed by
+sample number so gaps are samples the device dropped from the stream.
+"""
+
+import argparse
+import math
+import struct
+import sys
+import zlib
+
+MAGIC = b"DBIN"
+HEADER = struct.Struct("<4sBBHI")
+
+V1_HEADER = "timestamp_ms,temperature_C"
+
+
+def entry_format(version, entry_size):
+    """Struct for one entry of a LOG_FORMAT_VERSION, None if unsupported."""
+    if version == 1 and entry_size == 8:
+        return struct.Struct("<If")
+    if version == 2 and entry_size >= 8 and entry_size % 4 == 0:
+        return struct.Struct("<I%df" % ((entry_size - 4) // 4))
+    if version == 3 and entry_size >= 12 and entry_size % 4 == 0:
+        return struct.Struct("<Q%df" % ((entry_size - 8) // 4))
+    return None
+
+
+def format_row(values):
+    fields = [str(values[0])]
+    fields += ["" if math.isnan(v) else ("%.6g" % v) for v in values[1:]]
+    return ",".join(fields)
+
+
+def warn(msg):
+    print(msg, file=sys.stderr)
+
+
+def decode(data):
+    """Yield (first_index, entry_size, version, payload) per valid frame, stops at the end frame."""
+    pos = 0
+    while True:
+        pos = data.find(MAGIC, pos)
+        if pos < 0 or pos + HEADER.size > len(data):
+            warn("End frame not found, dump is incomplete")
+            return
+        _, version, entry_size, length, first_index = HEADER.unpack_from(data, pos)
+        end = pos + HEADER.size + length
+        if end + 4 > len(data):
+            warn("Truncated frame at byte %d" % pos)
+            return
+
+        (crc,) = struct.unpack_from("<I", data, end)
+        if zlib.crc32(data[pos:end]) != crc:
+            warn("CRC mismatch in frame at byte %d, skipping" % pos)
+            pos += 1
+            continue
+        if length == 0:
+            return
+
+        if entry_size != 0 and entry_format(version, entry_size) is None:
+            warn("Unsupported entry format version %d (entry size %d)" % (version, entry_size))
+            return
+
+        yield first_index, entry_size, version, data[pos + HEADER.size:end]
+        pos = end + 4
+
+
+def read_serial(port, baud, first, count):
+    import serial  # pyserial, only needed for live capture
+
+    with serial.Serial(port, baud, timeout=5) as ser:
+        ser.reset_input_buffer()
+        ser.write(("dumpbin %d %d\r" % (first, count)).encode())
+        data = bytearray()
+        while b"Dumped " not in data[-64:]:
+            chunk = ser.read(4096)
+            if not chunk:
+                warn("Timed out waiting for device")
+                break
+            data += chunk
+        data += ser.read_until(b"\n")
+        return bytes(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("capture", nargs="?", help="raw capture file, omit when using --port")
+    parser.add_argument("--port", help="serial port to request the dump from")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--from", dest="first", type=int, default=0, help="first retained entry")
+    parser.add_argument("--count", type=int, default=0, help="number of entries, 0 for all")
+    args = parser.parse_args()
+
+    if args.port:
+        data = read_serial(args.port, args.baud, args.first, args.count)
+    elif args.capture:
+        with open(args.capture, "rb") as f:
+            data = f.read()
+    else:
+        parser.error("either a capture file or --port is required")
+
+    csv_header = None
+    header_printed = False
+    expected = None
+    total = 0
+    for first_index, entry_size, version, payload in decode(data):
+        if entry_size == 0:
+            csv_header = payload.decode("ascii", "replace")
+            continue
+        entry = entry_format(version, entry_size)
+        if not header_printed:
+            if csv_header is None:
+                columns = len(entry.unpack(bytes(entry.size))) - 1
+                csv_header = V1_HEADER if version == 1 else ",".join(
+                    ["timestamp_ms"] + ["ch%d" % i for i in range(columns)])
+            print(csv_header)
+            header_printed = True
+        if expected is not None and first_index != expected:
+            warn("Gap of %d entries before entry %d" % (first_index - expected, first_index))
+        for values in entry.iter_unpack(payload):
+            print(format_row(values) if version > 1 else "%d,%.2f" % values)
+        expected = first_index + len(payload) // entry.size
+        total += len(payload) // entry.size
+
+    warn("Decoded %d entries" % total)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "log_storage.h"
+#include "flash_emu.h"
+
+// Host benchmark of the log storage component on the flash emulator. Every emulated boot runs in a
+// forked child, so storage state starts from zero like after a power-on while the flash contents
+// carry over. Results are CSV on stdout, one "# suite" line before each table
+
+#define BENCH_PARTITION_KB 1024          // Same as the storage partition in partitions.csv
+#define BENCH_PERIOD_MS 1000             // Timestamp step of generated entries
+#define BENCH_SETTINGS_MAGIC 0xBE4C0001
+#define BENCH_CUT_TRIALS 200
+#define BENCH_CUT_ENTRIES 3000           // Entries written per power cut trial
+#define BENCH_CUT_MAX_FLUSH 64           // Trials flush every 1..N entries
+
+// Stand-in for the application's settings, only has to round-trip through the journal
+typedef struct {
+    uint32_t magic;
+    uint32_t trial;
+} bench_settings_t;
+
+// Results of the last child, shared memory because a child stopped by a power cut cannot report
+typedef struct {
+    uint64_t base_ms;         // Timestamp of entry 0
+    uint32_t written;         // Entries handed to log_data_entry, the one in flight included
+    uint32_t committed;       // Entry number after the newest one on flash when the last call returned
+    uint32_t recovered;
+    uint32_t sectors;         // Retained log sectors after recovery
+    int64_t host_us;          // Host time of the measured part
+    uint64_t model_us;        // Modelled flash time of the measured part
+    flash_emu_counters_t counters;
+    uint64_t scan_model_us;   // Reading every sector header, recovery without a checkpoint
+} mailbox_t;
+
+typedef struct {
+    uint8_t format;
+    bool ring;
+    uint32_t fill_pct;        // Stop once this much of the log is used, above 100 wraps in ring mode
+    uint32_t entries;         // Stop after this many entries, 0 for no limit
+    uint32_t flush_every;     // log_flush after every N entries, 0 commits full pages only
+} workload_t;
+
+static const char* const s_format_names[] = { "raw", "packed" };
+static mailbox_t* s_mail;
+static const esp_partition_t* s_flash;
+
+static void make_entry(uint32_t i, log_entry_t* entry)
+{
+    // Slow steps like a temperature, whole numbers survive every column resolution
+    entry->timestamp = s_mail->base_ms + (uint64_t)i * BENCH_PERIOD_MS;
+    for (int col = 0; col < SENSOR_VALUE_COUNT; col++) {
+        entry->values[col] = (float)(20 + col + (i / 16) % 8);
+    }
+}
+
+// Run fn in a child process, returns its exit status, -1 if it crashed
+static int run_child(int (*fn)(const void*), const void* arg)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        _exit(fn(arg));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Power-on boot of the storage, returns the number of recovered entries or -1
+static int boot(bool ring, uint8_t format)
+{
+    bench_settings_t settings;
+    if (log_storage_init(s_flash, sizeof(settings)) != ESP_OK) {
+        return -1;
+    }
+    if (log_settings_load(s_flash, &settings) != ESP_OK || settings.magic != BENCH_SETTINGS_MAGIC) {
+        fprintf(stderr, "Settings journal lost\n");
+        return -1;
+    }
+    return (int)log_storage_recover(s_flash, ring, format);
+}
+
+static int child_format(const void* arg)
+{
+    bench_settings_t settings = { .magic = BENCH_SETTINGS_MAGIC };
+    if (log_storage_init(s_flash, sizeof(settings)) != ESP_OK || log_storage_format(s_flash, &settings) != ESP_OK) {
+        return 1;
+    }
+    s_mail->base_ms = log_time_ms();
+    return 0;
+}
+
+// Fresh partition with an empty log, as after the `reset` command
+static void format_partition(void)
+{
+    flash_emu_wipe();
+    if (run_child(child_format, NULL) != 0) {
+        fprintf(stderr, "Format failed\n");
+        exit(1);
+    }
+}
+
+static bool workload_done(const workload_t* work, uint32_t i, uint32_t full_at)
+{
+    if (work->entries) return i >= work->entries;
+    if (work->fill_pct > 100) return full_at && i >= (uint64_t)full_at * work->fill_pct / 100;
+    return (uint64_t)log_storage_used_bytes() * 100 >= (uint64_t)log_storage_size_bytes() * work->fill_pct ||
+           log_storage_get_stats()->dropped > 0;
+}
+
+static int child_write(const void* arg)
+{
+    const workload_t* work = arg;
+    if (boot(work->ring, work->format) < 0) return 1;
+    log_set_format(work->format);
+    log_set_ring_mode(work->ring);
+    flash_emu_reset_counters();
+    s_mail->written = 0;
+    s_mail->committed = 0;
+
+    // Full is where the next sector would no longer fit, the wrapped workload writes a multiple of it
+    uint32_t full_at = 0;
+    uint32_t i = 0;
+    int64_t start_us = esp_timer_get_time();
+    while (!workload_done(work, i, full_at)) {
+        log_entry_t entry;
+        make_entry(i, &entry);
+        s_mail->written = i + 1;
+        log_data_entry(s_flash, &entry);
+        i++;
+        if (work->flush_every && i % work->flush_every == 0) {
+            log_flush(s_flash);
+        }
+        if (!full_at && log_storage_used_bytes() + FLASH_SECTOR_SIZE > log_storage_size_bytes()) {
+            full_at = i;
+        }
+        s_mail->committed = log_storage_first() + log_storage_count();
+    }
+    log_flush(s_flash);
+    s_mail->host_us = esp_timer_get_time() - start_us;
+    s_mail->model_us = flash_emu_model_us();
+    s_mail->committed = log_storage_first() + log_storage_count();
+    s_mail->counters = *flash_emu_counters();
+    return 0;
+}
+
+static void write_workload(const workload_t* work)
+{
+    if (run_child(child_write, work) != 0) {
+        fprintf(stderr, "Write workload failed\n");
+        exit(1);
+    }
+}
+
+static int child_recover(const void* arg)
+{
+    const workload_t* work = arg;
+    flash_emu_reset_counters();
+    int64_t start_us = esp_timer_get_time();
+    int recovered = boot(work->ring, work->format);
+    s_mail->host_us = esp_timer_get_time() - start_us;
+    s_mail->model_us = flash_emu_model_us();
+    s_mail->counters = *flash_emu_counters();
+    if (recovered < 0) return 1;
+    s_mail->recovered = recovered;
+    uint32_t tail_seq, head_seq;
+    log_storage_sectors(&tail_seq, &head_seq);
+    s_mail->sectors = head_seq - tail_seq + 1;
+
+    flash_emu_reset_counters();
+    uint32_t newest;
+    log_find_newest_sector(s_flash, &newest);
+    s_mail->scan_model_us = flash_emu_model_us();
+    return 0;
+}
+
+static void bench_recovery(void)
+{
+    static const uint32_t fills[] = { 0, 10, 25, 50, 75, 90, 100, 150 };
+    printf("# recovery\n");
+    printf("format,fill_pct,ring,entries,sectors,recover_host_us,recover_model_us,reads,read_bytes,header_scan_model_us\n");
+    for (uint8_t format = LOG_FORMAT_RAW; format <= LOG_FORMAT_PACKED; format++) {
+        for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+            workload_t work = { .format = format, .ring = fills[f] > 100, .fill_pct = fills[f] };
+            format_partition();
+            write_workload(&work);
+            if (run_child(child_recover, &work) != 0) {
+                fprintf(stderr, "Recovery failed at %lu%%\n", (unsigned long)fills[f]);
+                exit(1);
+            }
+            const flash_emu_counters_t* c = &s_mail->counters;
+            printf("%s,%lu,%s,%lu,%lu,%lld,%llu,%llu,%llu,%llu\n", s_format_names[format],
+                   (unsigned long)fills[f], work.ring ? "on" : "off", (unsigned long)s_mail->recovered,
+                   (unsigned long)s_mail->sectors, (long long)s_mail->host_us,
+                   (unsigned long long)s_mail->model_us, (unsigned long long)c->reads,
+                   (unsigned long long)c->read_bytes, (unsigned long long)s_mail->scan_model_us);
+        }
+    }
+}
+
+// Sustained writes into an empty log until it is 90% used, with full-page commits and with a flush
+// after every entry, the worst case of FLUSH_MAX_LATENCY_MS flushes at slow logging periods
+static const uint32_t s_flush_cadences[] = { 0, 16, 1 };
+
+static void bench_throughput(void)
+{
+    printf("# throughput\n");
+    printf("format,flush_every,entries,host_us,host_entries_per_s,program_model_us,erase_model_us,"
+           "model_entries_per_s,model_entries_per_s_pre_erased\n");
+    for (uint8_t format = LOG_FORMAT_RAW; format <= LOG_FORMAT_PACKED; format++) {
+        for (size_t k = 0; k < sizeof(s_flush_cadences) / sizeof(s_flush_cadences[0]); k++) {
+            workload_t work = { .format = format, .fill_pct = 90, .flush_every = s_flush_cadences[k] };
+            format_partition();
+            write_workload(&work);
+            const flash_emu_counters_t* c = &s_mail->counters;
+            uint32_t n = s_mail->committed;  // Linear log, entry numbers start at 0
+            // On the device the erase task clears sectors ahead of the head, the last column leaves erases out
+            printf("%s,%lu,%lu,%lld,%.0f,%llu,%llu,%.0f,%.0f\n", s_format_names[format],
+                   (unsigned long)work.flush_every, (unsigned long)n, (long long)s_mail->host_us,
+                   s_mail->host_us ? n * 1e6 / s_mail->host_us : 0.0,
+                   (unsigned long long)c->program_us, (unsigned long long)c->erase_us,
+                   s_mail->model_us ? n * 1e6 / s_mail->model_us : 0.0,
+                   c->program_us ? n * 1e6 / c->program_us : 0.0);
+        }
+    }
+}
+
+// Bytes programmed and erased per byte of log_entry_t handed to the storage, same workloads as above
+static void bench_amplification(void)
+{
+    printf("# amplification\n");
+    printf("format,flush_every,entries,logical_bytes,programmed_bytes,erased_bytes,writes,"
+           "program_amplification,erase_amplification,nor_violations\n");
+    for (uint8_t format = LOG_FORMAT_RAW; format <= LOG_FORMAT_PACKED; format++) {
+        for (size_t k = 0; k < sizeof(s_flush_cadences) / sizeof(s_flush_cadences[0]); k++) {
+            workload_t work = { .format = format, .fill_pct = 90, .flush_every = s_flush_cadences[k] };
+            format_partition();
+            write_workload(&work);
+            const flash_emu_counters_t* c = &s_mail->counters;
+            uint64_t logical = (uint64_t)s_mail->committed * sizeof(log_entry_t);  // Linear log as above
+            uint64_t erased = c->erases * FLASH_EMU_SECTOR_SIZE;
+            printf("%s,%lu,%lu,%llu,%llu,%llu,%llu,%.3f,%.3f,%llu\n", s_format_names[format],
+                   (unsigned long)work.flush_every, (unsigned long)s_mail->committed,
+                   (unsigned long long)logical, (unsigned long long)c->write_bytes, (unsigned long long)erased,
+                   (unsigned long long)c->writes, logical ? (double)c->write_bytes / logical : 0.0,
+                   logical ? (double)erased / logical : 0.0, (unsigned long long)c->nor_violations);
+        }
+    }
+}
+
+typedef struct {
+    workload_t work;
+    uint64_t cut_op;
+    uint32_t seed;
+} cut_trial_t;
+
+static int child_cut(const void* arg)
+{
+    const cut_trial_t* trial = arg;
+    flash_emu_cut_after(trial->cut_op, trial->seed);
+    return child_write(&trial->work);
+}
+
+// Everything acknowledged before the cut must come back in order and unchanged, nothing that was
+// never written may appear, and the log must accept new entries afterwards. Ring mode may have
+// reclaimed the oldest entries, so the check is on entry numbers
+static int child_verify(const void* arg)
+{
+    const workload_t* work = arg;
+    flash_emu_reset_counters();
+    int recovered = boot(work->ring, work->format);
+    if (recovered < 0) return 1;
+    s_mail->recovered = recovered;
+    uint32_t first = log_storage_first();
+    uint32_t end = first + recovered;
+    if (end < s_mail->committed || end > s_mail->written) {
+        fprintf(stderr, "Recovered entries up to %lu, %lu committed, %lu written\n", (unsigned long)end,
+                (unsigned long)s_mail->committed, (unsigned long)s_mail->written);
+        return 1;
+    }
+    for (uint32_t i = 0; i < (uint32_t)recovered; i++) {
+        log_entry_t expected, entry;
+        make_entry(first + i, &expected);
+        if (log_read_entry(s_flash, i, &entry) != ESP_OK || memcmp(&entry, &expected, sizeof(entry)) != 0) {
+            fprintf(stderr, "Entry %lu differs after recovery\n", (unsigned long)i);
+            return 1;
+        }
+    }
+
+    // A full linear log drops the entry instead, as it did before the cut
+    log_entry_t entry;
+    make_entry(end, &entry);
+    esp_err_t err = log_data_entry(s_flash, &entry);
+    if (err == ESP_OK) err = log_flush(s_flash);
+    bool full = !work->ring && err == ESP_ERR_NO_MEM && log_storage_get_stats()->dropped == 1;
+    if (!full && (err != ESP_OK || log_storage_first() + log_storage_count() != end + 1)) {
+        fprintf(stderr, "Log does not accept entries after recovery: %s\n", esp_err_to_name(err));
+        return 1;
+    }
+    s_mail->counters = *flash_emu_counters();
+    return s_mail->counters.nor_violations ? 1 : 0;
+}
+
+// xorshift32, trials are reproducible from the seed
+static uint32_t bench_random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static bool bench_powercut(uint32_t trials, uint32_t seed)
+{
+    printf("# powercut\n");
+    printf("trial,format,ring,flush_every,cut_op,total_ops,written,committed,recovered,result\n");
+    uint32_t state = seed ? seed : 1;
+    uint32_t passed = 0;
+    for (uint32_t t = 0; t < trials; t++) {
+        cut_trial_t trial = {
+            .work = {
+                .format = (t % 2) ? LOG_FORMAT_PACKED : LOG_FORMAT_RAW,
+                .ring = (t % 4) >= 2,
+                .entries = BENCH_CUT_ENTRIES,
+                .flush_every = 1 + bench_random(&state) % BENCH_CUT_MAX_FLUSH,
+            },
+            .seed = bench_random(&state),
+        };
+
+        // Dry run for the number of flash operations, the cut lands on any one of them
+        format_partition();
+        write_workload(&trial.work);
+        uint64_t total_ops = s_mail->counters.ops;
+        trial.cut_op = 1 + bench_random(&state) % total_ops;
+
+        format_partition();
+        int status = run_child(child_cut, &trial);
+        bool ok = status == FLASH_EMU_CUT_EXIT && run_child(child_verify, &trial.work) == 0;
+        passed += ok;
+        printf("%lu,%s,%s,%lu,%llu,%llu,%lu,%lu,%lu,%s\n", (unsigned long)t, s_format_names[trial.work.format],
+               trial.work.ring ? "on" : "off", (unsigned long)trial.work.flush_every, (unsigned long long)trial.cut_op,
+               (unsigned long long)total_ops, (unsigned long)s_mail->written, (unsigned long)s_mail->committed,
+               (unsigned long)s_mail->recovered, ok ? "pass" : "FAIL");
+    }
+    fprintf(stderr, "Power cut trials: %lu of %lu passed\n", (unsigned long)passed, (unsigned long)trials);
+    return passed == trials;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [recovery|throughput|amplification|powercut|all]...\n"
+            "  --flash FILE   Keep the emulated partition in FILE instead of memory\n"
+            "  --size KB      Partition size, default %d\n"
+            "  --split KB     Move the last KB of it to a second partition the log continues on\n"
+            "  --trials N     Power cut trials, default %d\n"
+            "  --seed N       Seed of the power cut trials, default 1\n"
+            "  -v             Storage log messages on stderr\n",
+            name, BENCH_PARTITION_KB, BENCH_CUT_TRIALS);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = NULL;
+    uint32_t size_kb = BENCH_PARTITION_KB;
+    uint32_t split_kb = 0;
+    uint32_t trials = BENCH_CUT_TRIALS;
+    uint32_t seed = 1;
+    const char* suites[8];
+    int num_suites = 0;
+
+    // Torn writes are the point of the power cut suite, their warnings would drown the results
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--flash") == 0 && has_value) {
+            path = argv[++i];
+        } else if (strcmp(argv[i], "--size") == 0 && has_value) {
+            size_kb = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--split") == 0 && has_value) {
+            split_kb = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--trials") == 0 && has_value) {
+            trials = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+            seed = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-v") == 0) {
+            esp_log_level_set("*", ESP_LOG_INFO);
+        } else if (argv[i][0] != '-' && num_suites < (int)(sizeof(suites) / sizeof(suites[0]))) {
+            suites[num_suites++] = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (num_suites == 0) {
+        suites[num_suites++] = "all";
+    }
+
+    if (flash_emu_init(size_kb * 1024, path) != ESP_OK) {
+        return 1;
+    }
+    s_flash = flash_emu_partition();
+    if (split_kb) {
+        // Added before any child initializes the storage, every child inherits the backend
+        const esp_partition_t* second = flash_emu_split(split_kb * 1024);
+        log_backend_t backend;
+        if (!second) {
+            fprintf(stderr, "Split of %lu KB does not fit the partition\n", (unsigned long)split_kb);
+            return 1;
+        }
+        log_backend_partition(second, &backend);
+        if (log_storage_add_backend(&backend) != ESP_OK) {
+            return 1;
+        }
+    }
+    s_mail = mmap(NULL, sizeof(*s_mail), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s_mail == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < num_suites; i++) {
+        bool all = strcmp(suites[i], "all") == 0;
+        bool known = all;
+        if (all || strcmp(suites[i], "recovery") == 0) {
+            bench_recovery();
+            known = true;
+        }
+        if (all || strcmp(suites[i], "throughput") == 0) {
+            bench_throughput();
+            known = true;
+        }
+        if (all || strcmp(suites[i], "amplification") == 0) {
+            bench_amplification();
+            known = true;
+        }
+        if (all || strcmp(suites[i], "powercut") == 0) {
+            ok &= bench_powercut(trials, seed);
+            known = true;
+        }
+        if (!known) {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "flash_emu.h"
+
+static uint8_t* s_flash = NULL;
+static esp_partition_t s_partition = {
+    .type = ESP_PARTITION_TYPE_DATA,
+    .subtype = 0x40,
+    .address = 0x100000,
+    .erase_size = FLASH_EMU_SECTOR_SIZE,
+    .label = "storage",
+};
+static esp_partition_t s_second = {
+    .type = ESP_PARTITION_TYPE_DATA,
+    .subtype = 0x40,
+    .erase_size = FLASH_EMU_SECTOR_SIZE,
+    .label = "storage2",
+};
+static flash_emu_counters_t s_counters;
+static uint64_t s_cut_left = 0;           // Writes and erases until power is cut, 0 if never
+static uint32_t s_cut_seed = 0;
+
+// xorshift32, the tear position only has to be reproducible from the seed
+static uint32_t cut_random(void)
+{
+    s_cut_seed ^= s_cut_seed << 13;
+    s_cut_seed ^= s_cut_seed >> 17;
+    s_cut_seed ^= s_cut_seed << 5;
+    return s_cut_seed;
+}
+
+static bool cut_now(void)
+{
+    s_counters.ops++;
+    return s_cut_left != 0 && --s_cut_left == 0;
+}
+
+static void power_cut(void)
+{
+    _exit(FLASH_EMU_CUT_EXIT);
+}
+
+esp_err_t flash_emu_init(uint32_t size, const char* path)
+{
+    if (size == 0 || size % FLASH_EMU_SECTOR_SIZE != 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    void* mem;
+    if (path) {
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) {
+            perror(path);
+            if (fd >= 0) close(fd);
+            return ESP_FAIL;
+        }
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return ESP_FAIL;
+    }
+
+    s_flash = mem;
+    s_partition.size = size;
+    flash_emu_wipe();
+    return ESP_OK;
+}
+
+const esp_partition_t* flash_emu_partition(void)
+{
+    return &s_partition;
+}
+
+const esp_partition_t* flash_emu_split(uint32_t size)
+{
+    if (size == 0 || size % FLASH_EMU_SECTOR_SIZE != 0 || size >= s_partition.size || s_second.size != 0) {
+        return NULL;
+    }
+    s_partition.size -= size;
+    s_second.address = s_partition.address + s_partition.size;
+    s_second.size = size;
+    return &s_second;
+}
+
+void flash_emu_wipe(void)
+{
+    memset(s_flash, 0xFF, s_partition.size + s_second.size);
+}
+
+flash_emu_counters_t* flash_emu_counters(void)
+{
+    return &s_counters;
+}
+
+void flash_emu_reset_counters(void)
+{
+    memset(&s_counters, 0, sizeof(s_counters));
+}
+
+uint64_t flash_emu_model_us(void)
+{
+    return s_counters.read_us + s_counters.program_us + s_counters.erase_us;
+}
+
+void flash_emu_cut_after(uint64_t op, uint32_t seed)
+{
+    s_cut_left = op;
+    s_cut_seed = seed ? seed : 1;
+}
+
+// Checks the range and makes offset one into the emulated chip
+static bool in_range(const esp_partition_t* partition, size_t* offset, size_t size)
+{
+    if (partition != &s_partition && (partition != &s_second || s_second.size == 0)) {
+        return false;
+    }
+    if (*offset > partition->size || size > partition->size - *offset) {
+        return false;
+    }
+    *offset += partition->address - s_partition.address;
+    return true;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size)
+{
+    if (!in_range(partition, &src_offset, size)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, s_flash + src_offset, size);
+    s_counters.reads++;
+    s_counters.read_bytes += size;
+    s_counters.read_us += FLASH_EMU_CALL_US + (size * FLASH_EMU_READ_NS_PER_BYTE) / 1000;
+    return ESP_OK;
+}
+
+// Program bytes, NOR flash can only clear bits
+static void program(size_t offset, const uint8_t* src, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (src[i] & ~s_flash[offset + i]) {
+            s_counters.nor_violations++;
+        }
+        s_flash[offset + i] &= src[i];
+    }
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size)
+{
+    if (!in_range(partition, &dst_offset, size)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t* bytes = src;
+
+    if (cut_now()) {
+        size_t done = size ? cut_random() % size : 0;
+        program(dst_offset, bytes, done);
+        if (done < size) {
+            s_flash[dst_offset + done] &= bytes[done] | (uint8_t)cut_random();
+        }
+        power_cut();
+    }
+
+    program(dst_offset, bytes, size);
+    s_counters.writes++;
+    s_counters.write_bytes += size;
+    s_counters.program_us += FLASH_EMU_CALL_US;
+    for (size_t offset = dst_offset; offset < dst_offset + size;) {
+        // The driver splits writes at page boundaries
+        size_t chunk = FLASH_EMU_PAGE_SIZE - offset % FLASH_EMU_PAGE_SIZE;
+        if (chunk > dst_offset + size - offset) chunk = dst_offset + size - offset;
+        s_counters.program_us += FLASH_EMU_PROGRAM_US + (chunk * FLASH_EMU_PROGRAM_NS_PER_BYTE) / 1000;
+        offset += chunk;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size)
+{
+    if (!in_range(partition, &offset, size)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (offset % FLASH_EMU_SECTOR_SIZE != 0 || size % FLASH_EMU_SECTOR_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (cut_now()) {
+        memset(s_flash + offset, 0xFF, cut_random() % FLASH_EMU_SECTOR_SIZE);
+        power_cut();
+    }
+
+    memset(s_flash + offset, 0xFF, size);
+    s_counters.erases += size / FLASH_EMU_SECTOR_SIZE;
+    s_counters.erase_us += FLASH_EMU_CALL_US + (size / FLASH_EMU_SECTOR_SIZE) * FLASH_EMU_ERASE_US;
+    return ESP_OK;
+}
+
+// Reads through the mapping bypass the counters and the timing model
+esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size,
+                             esp_partition_mmap_memory_t memory, const void** out_ptr,
+                             esp_partition_mmap_handle_t* out_handle)
+{
+    if (!in_range(partition, &offset, size)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *out_ptr = s_flash + offset;
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle)
+{
+}
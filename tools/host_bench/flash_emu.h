@@ -0,0 +1,69 @@
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+// NOR flash emulator behind the esp_partition_* calls of the host build. Writes can only clear bits
+// and erases work on whole 4 KB sectors, as on the chip. Contents live in shared memory, so a forked
+// child sees what its parent wrote and the parent sees what a child wrote before it died. Flash
+// busy time is modelled from the constants below, typical values from 25Q-series SPI NOR datasheets,
+// not measured on the device
+
+#define FLASH_EMU_SECTOR_SIZE 4096
+#define FLASH_EMU_PAGE_SIZE 256               // A program operation never crosses a page
+#define FLASH_EMU_CALL_US 10                  // Driver entry per esp_partition_* call, cache disable and re-enable
+#define FLASH_EMU_READ_NS_PER_BYTE 50         // 80 MHz dual I/O
+#define FLASH_EMU_PROGRAM_US 8                // Command and status polling per page program
+#define FLASH_EMU_PROGRAM_NS_PER_BYTE 1500    // tPP about 0.4 ms for a full page
+#define FLASH_EMU_ERASE_US 45000              // tSE, 4 KB sector erase
+#define FLASH_EMU_CUT_EXIT 42                 // Exit status of a process stopped by a power cut
+
+typedef struct {
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t writes;              // esp_partition_write calls
+    uint64_t write_bytes;
+    uint64_t erases;              // Sectors
+    uint64_t ops;                 // Writes and erase calls, what a power cut budget counts
+    uint64_t nor_violations;      // Bytes written with a 1 over a 0, silently lost on real flash
+    uint64_t read_us;             // Modelled busy time per kind of operation
+    uint64_t program_us;
+    uint64_t erase_us;
+} flash_emu_counters_t;
+
+/**
+ * @brief Create the emulated partition, all bytes erased
+ *
+ * @param size Partition size, a multiple of FLASH_EMU_SECTOR_SIZE
+ * @param path Image file to keep the contents in, NULL for anonymous memory
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE, ESP_FAIL if the file cannot be mapped
+ */
+esp_err_t flash_emu_init(uint32_t size, const char* path);
+
+const esp_partition_t* flash_emu_partition(void);
+
+// Cut the last size bytes off the emulated partition into a second one, for a log continued on a
+// further partition. Returns it, NULL if size does not leave both a whole number of sectors
+const esp_partition_t* flash_emu_split(uint32_t size);
+
+// Erase the whole emulated chip, both partitions, without counting it
+void flash_emu_wipe(void);
+
+// Counters of this process since the last reset
+flash_emu_counters_t* flash_emu_counters(void);
+void flash_emu_reset_counters(void);
+
+// Modelled busy time of all counted operations
+uint64_t flash_emu_model_us(void);
+
+/**
+ * @brief Cut power during the op-th write or erase call from now on, counter resets do not move it
+ *
+ * The interrupted write programs a random prefix of its bytes and leaves one byte partly
+ * programmed. The interrupted erase resets a random prefix of the first sector to 0xFF and leaves
+ * the rest as it was. The process then exits with FLASH_EMU_CUT_EXIT.
+ *
+ * @param op 1 for the next call, 0 to disable
+ * @param seed Picks the tear position
+ */
+void flash_emu_cut_after(uint64_t op, uint32_t seed);
@@ -0,0 +1,15 @@
+#pragma once
+#include "esp_err.h"
+
+// Only for sensors.c to compile, the benchmark never initializes sensors
+typedef struct temperature_sensor_obj_t* temperature_sensor_handle_t;
+
+typedef struct {
+    int range_min;
+    int range_max;
+    int clk_src;
+} temperature_sensor_config_t;
+
+esp_err_t temperature_sensor_install(const temperature_sensor_config_t* config, temperature_sensor_handle_t* handle);
+esp_err_t temperature_sensor_enable(temperature_sensor_handle_t handle);
+esp_err_t temperature_sensor_get_celsius(temperature_sensor_handle_t handle, float* celsius);
@@ -0,0 +1,6 @@
+#pragma once
+
+// No RTC memory on the host, a forked child starts from the parent's copy like a power-on reset
+#define RTC_NOINIT_ATTR
+#define RTC_DATA_ATTR
+#define IRAM_ATTR
@@ -0,0 +1,6 @@
+#pragma once
+#include <stdint.h>
+
+// Same polynomials and init/final inversion as the ESP32 ROM functions
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len);
+uint16_t esp_rom_crc16_le(uint16_t crc, const uint8_t* buf, uint32_t len);
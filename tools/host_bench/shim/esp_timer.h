@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+
+// Host monotonic clock in microseconds
+int64_t esp_timer_get_time(void);